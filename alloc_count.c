@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+/*
+ * Test hook (Linux/glibc only): LD_PRELOAD this to count the heap
+ * allocations a program makes between the end of its startup
+ * (constructors) and its first exec, which is printed on stderr as
+ *
+ *     alloc_count: <n> allocations before exec
+ *
+ * "make check-allocs" uses it to show that the wrapper's launch path
+ * does not allocate.
+ */
+
+extern char **environ;
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+static unsigned long count;
+static int armed;
+
+__attribute__((constructor)) static void arm(void)
+{
+    armed = 1;
+}
+
+void *malloc(size_t n)
+{
+    count += armed;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    count += armed;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n)
+{
+    count += armed;
+    return __libc_realloc(p, n);
+}
+
+int posix_memalign(void **p, size_t align, size_t n)
+{
+    count += armed;
+    *p = __libc_memalign(align, n);
+    return *p ? 0 : -1;
+}
+
+static void report(void)
+{
+    char buf[64];
+    int n;
+
+    if (!armed)
+        return;
+    armed = 0;
+    n = snprintf(buf, sizeof(buf), "alloc_count: %lu allocations before exec\n", count);
+    if (n > 0)
+        n = write(2, buf, n);
+}
+
+int execv(const char *path, char * const argv[])
+{
+    report();
+    return execve(path, argv, environ);
+}
+
+int execve(const char *path, char * const argv[], char * const envp[])
+{
+    int (*real)(const char *, char * const [], char * const []);
+
+    report();
+    *(void **)&real = dlsym(RTLD_NEXT, "execve");
+    return real(path, argv, envp);
+}
+
+int execvp(const char *file, char * const argv[])
+{
+    int (*real)(const char *, char * const []);
+
+    report();
+    *(void **)&real = dlsym(RTLD_NEXT, "execvp");
+    return real(file, argv);
+}
@@ -0,0 +1,286 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <sys/errno.h>
+#include <sys/utsname.h>
+
+#include "msg.h"
+#include "move_to_user_namespace.h"
+#include "backend.h"
+#include "stats.h"
+#include "user_path.h"
+#include "trace.h"
+
+/*
+ * Picks a backend and walks its fallback chain.
+ *
+ * The backend that worked is remembered, keyed on the kernel release,
+ * in "backend" in the per-user directory (one line: "<release> <name>").
+ * While the release matches, later runs start with that backend and
+ * skip parsing the release; a stale or broken cache only costs a
+ * fallback step.
+ *
+ * A move that libreattach gave up waiting for (REATTACH_TIMEOUT_MS)
+ * may still return later on its own thread. Once it has been
+ * abandoned it records nothing: no counters, no cache.
+ */
+
+#define CACHE_NAME "backend"
+#define MAX_BACKENDS 8
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int abandoned;
+
+/* waits for a move that is recording its result to finish doing so */
+void reattach_abandon_move(void)
+{
+    pthread_mutex_lock(&record_lock);
+    abandoned = 1;
+    pthread_mutex_unlock(&record_lock);
+}
+
+const struct reattach_backend *reattach_backend_named(const char *name)
+{
+    const struct reattach_backend *b;
+    for (b = reattach_backends; b->name; b++)
+        if (!strcmp(b->name, name))
+            return b;
+    return NULL;
+}
+
+const struct reattach_backend *reattach_backend_for_os(unsigned int os)
+{
+    const struct reattach_backend *b;
+    for (b = reattach_backends; b->name; b++)
+        if (b->os == os)
+            return b;
+    return NULL;
+}
+
+/* why each backend's probe failed, for the warning if nothing else works */
+static char probe_error[MAX_BACKENDS][160];
+
+/* 0 if every symbol b needs is present; looked up only once */
+int reattach_backend_probe(const struct reattach_backend *b)
+{
+    static signed char probed[MAX_BACKENDS]; /* 0 unknown, 1 ok, -1 missing */
+    int i, idx = b - reattach_backends;
+
+    if (idx < MAX_BACKENDS && probed[idx])
+        return probed[idx] > 0 ? 0 : -1;
+
+    int r = 0;
+    TRACE_BEGIN("dlsym", b->name);
+    for (i = 0; b->symbols[i]; i++)
+        if (!(b->resolved[i] = dlsym(RTLD_NEXT, b->symbols[i]))) {
+            const char *e = dlerror();
+            if (idx < MAX_BACKENDS)
+                snprintf(probe_error[idx], sizeof(probe_error[idx]), "%s: %s",
+                        b->symbols[i], e ? e : "not found");
+            r = -1;
+            break;
+        }
+    TRACE_END("dlsym", b->name);
+    if (idx < MAX_BACKENDS)
+        probed[idx] = r ? -1 : 1;
+    return r;
+}
+
+/* the symbol b's probe could not find, and dlerror's reason */
+static const char *probe_why(const struct reattach_backend *b)
+{
+    int idx = b - reattach_backends;
+
+    return idx < MAX_BACKENDS && probe_error[idx][0] ? probe_error[idx] : "its symbols";
+}
+
+/*
+ * Map a Darwin kernel release (e.g. "14.5.0") to a "reattach
+ * variation" (the first OS X release whose reattach method works):
+ *
+ *  older => 100500 with warning
+ *   10.5 => 100500
+ *   10.6 => 100600
+ *   10.7 => 100600
+ *   10.8 => 100600
+ *   10.9 => 100600
+ *   10.10=> 101000
+ *   10.11=> 101000
+ *   10.12=> 101000
+ *   10.13=> 101000
+ *   10.14=> 101000
+ *   10.15=> 101000
+ *  newer => 101000
+ */
+unsigned int reattach_variation(const char *release, const char *argv0)
+{
+    unsigned int os = 0;
+    char *rest;
+    long major = strtol(release, &rest, 10);
+
+    if (rest != release && (*rest == '.' || *rest == '\0')) {
+        os = 100000;    /* 10.1, 10.0 and prior betas/previews */
+        if (major >= 6) /* 10.2 and newer */
+            os += (major-4) * 100;
+    }
+    else
+        warn("unparsable major release number: '%s'", release);
+
+    if (100600 <= os && os <= 100900)
+        os = 100600;
+    else if (101000 <= os && os <= 101500)
+        os = 101000;
+    else if (os < 100500) {
+        warn("%s: unsupported old OS, trying as if it were 10.5", argv0);
+        os = 100500;
+    } else if (os > 101500) {
+        /*
+        warn("%s: unsupported new OS, trying as if it were 10.10", argv0);
+        */
+        os = 101000;
+    }
+    return os;
+}
+
+static const struct reattach_backend *cache_read(const char *release)
+{
+    char path[PATH_MAX], buf[128];
+    int fd;
+    ssize_t n;
+
+    if (user_path(path, sizeof(path), CACHE_NAME))
+        return NULL;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return NULL;
+    buf[n] = '\0';
+
+    char *sp = strchr(buf, ' '), *nl = strchr(buf, '\n');
+    if (!sp || !nl || nl < sp)
+        return NULL;
+    *sp = *nl = '\0';
+    if (strcmp(buf, release))
+        return NULL;
+    return reattach_backend_named(sp + 1);
+}
+
+/* best effort; written to a temporary name and renamed into place */
+static void cache_write(const char *release, const struct reattach_backend *b)
+{
+    char path[PATH_MAX], tmp[PATH_MAX], buf[128];
+    int fd, n;
+
+    if (user_path(path, sizeof(path), CACHE_NAME))
+        return;
+    n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp))
+        return;
+    n = snprintf(buf, sizeof(buf), "%s %s\n", release, b->name);
+    if (n < 0 || (size_t)n >= sizeof(buf))
+        return;
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+        return;
+    if (write(fd, buf, n) != n || close(fd) || rename(tmp, path))
+        unlink(tmp);
+}
+
+/*
+ * Move into the per-user namespace with the cached (or the release's)
+ * backend, falling back along the chain until one works.
+ *
+ * Returns 0 on success, -1 (with warnings) if every backend failed.
+ */
+int reattach_to_user_namespace(const char *argv0)
+{
+    const struct reattach_backend *cached, *b;
+    unsigned char tried[MAX_BACKENDS] = { 0 };
+    const char *missing = NULL;
+    struct utsname u;
+    int r;
+
+    TRACE_BEGIN("uname", NULL);
+#ifdef REATTACH_STUB
+    r = stub_uname(&u);
+#else
+    r = uname(&u);
+#endif
+    TRACE_END("uname", NULL);
+    if (r) {
+        warn_errno("uname failed");
+        return -1;
+    }
+    if (strcmp(u.sysname, "Darwin")) {
+        warn("unsupported OS sysname: %s", u.sysname);
+        return -1;
+    }
+
+    TRACE_BEGIN("backend cache", NULL);
+    b = cached = cache_read(u.release);
+    TRACE_END("backend cache", NULL);
+    if (!b)
+        b = reattach_backend_for_os(reattach_variation(u.release, argv0));
+    if (!b) {
+        warn("no reattach backend for release %s", u.release);
+        return -1;
+    }
+
+    while (b) {
+        int idx = b - reattach_backends;
+        if (idx < MAX_BACKENDS) {
+            if (tried[idx])
+                break;
+            tried[idx] = 1;
+        }
+
+        /* a probe failure just means "not on this release": only
+         * worth reporting if no backend works */
+        if (reattach_backend_probe(b))
+            missing = probe_why(b);
+        else {
+            TRACE_BEGIN("move", b->name);
+            r = b->move(b);
+            TRACE_END("move", b->name);
+            pthread_mutex_lock(&record_lock);
+            if (abandoned) {
+                pthread_mutex_unlock(&record_lock);
+                return -1;
+            }
+            stats_backend(idx, b->name, r == 0);
+            if (r == 0 && b != cached)
+                cache_write(u.release, b);
+            pthread_mutex_unlock(&record_lock);
+            if (r == 0)
+                return 0;
+            warn("reattach with %s failed", b->name);
+        }
+
+        b = b->fallback ? reattach_backend_named(b->fallback) : NULL;
+    }
+    if (missing)
+        warn("unable to find %s", missing);
+    return -1;
+}
+
+/* exactly the backend for os, no fallback (used by test) */
+int move_to_user_namespace(unsigned int os)
+{
+    const struct reattach_backend *b = reattach_backend_for_os(os);
+
+    if (!b) {
+        warn("move_to_user_namespace: unhandled os value: %u", os);
+        return -1;
+    }
+    if (reattach_backend_probe(b)) {
+        warn("move_to_user_namespace: %s: unable to find %s", b->name, probe_why(b));
+        return -1;
+    }
+    return b->move(b);
+}
@@ -0,0 +1,25 @@
+/*
+ * A way of moving into the per-user bootstrap namespace.
+ *
+ * Each backend names the symbols it needs; they are looked up (once per
+ * process) with dlsym before move is called. If a backend can not be
+ * used or its move fails, its fallback (if any) is tried next.
+ */
+struct reattach_backend {
+    const char *name;             /* e.g. "10.10" */
+    unsigned int os;              /* "reattach variation", see reattach_variation */
+    const char * const *symbols;  /* NULL terminated */
+    void **resolved;              /* one slot per symbol, filled by the probe */
+    int (*move)(const struct reattach_backend *b);
+    const char *fallback;
+};
+
+/* provided by move_to_user_namespace.c (or its stub) */
+extern const struct reattach_backend reattach_backends[];
+
+const struct reattach_backend *reattach_backend_named(const char *name);
+const struct reattach_backend *reattach_backend_for_os(unsigned int os);
+int reattach_backend_probe(const struct reattach_backend *b);
+unsigned int reattach_variation(const char *release, const char *argv0);
+int reattach_to_user_namespace(const char *argv0);
+void reattach_abandon_move(void);
@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/errno.h>
+#include <sys/wait.h>
+
+#include "msg.h"
+#include "batch.h"
+
+/*
+ * Batch mode: one (already reattached) process launches a whole list
+ * of commands with posix_spawnp, at most "jobs" of them at a time.
+ *
+ * The list is read from a file (or stdin). By default each non-blank
+ * line that does not start with '#' is one command, split into words
+ * on spaces and tabs (there is no quoting). With -0 the list is NUL
+ * delimited: each record is one word and an empty record ends the
+ * command.
+ *
+ * Words of the form <path, >path, >>path, 2>path and 2>>path redirect
+ * the command's stdin, stdout and stderr. Stdin defaults to /dev/null
+ * (the commands run side by side, so none of them gets ours); stdout
+ * and stderr default to ours.
+ */
+
+extern char **environ;
+
+struct batch_cmd {
+    size_t word;        /* index of argv[0] in batch.words */
+    char **argv;
+    const char *in, *out, *err;
+    int out_append, err_append;
+    pid_t pid;
+    int status;
+};
+
+struct batch {
+    char *buf;
+    char **words;       /* each command's words, then a NULL */
+    size_t nwords, words_alloc;
+    struct batch_cmd *cmds;
+    size_t ncmds, cmds_alloc;
+    int jobs;           /* 0: no limit */
+};
+
+static void *grow(void *p, size_t *alloc, size_t want, size_t size)
+{
+    if (want <= *alloc)
+        return p;
+    *alloc = *alloc ? *alloc * 2 : 16;
+    if (*alloc < want)
+        *alloc = want;
+    if (!(p = realloc(p, *alloc * size)))
+        die(2, "batch: out of memory");
+    return p;
+}
+
+static void add_word(struct batch *b, char *w)
+{
+    b->words = grow(b->words, &b->words_alloc, b->nwords + 1, sizeof(*b->words));
+    b->words[b->nwords++] = w;
+}
+
+static struct batch_cmd *cur_cmd(struct batch *b, int start)
+{
+    if (start) {
+        b->cmds = grow(b->cmds, &b->cmds_alloc, b->ncmds + 1, sizeof(*b->cmds));
+        memset(&b->cmds[b->ncmds], 0, sizeof(*b->cmds));
+        b->cmds[b->ncmds].word = b->nwords;
+        b->ncmds++;
+    }
+    return &b->cmds[b->ncmds - 1];
+}
+
+/* file a word of the current command as an argument or a redirection */
+static void cmd_word(struct batch *b, char *w)
+{
+    struct batch_cmd *c = cur_cmd(b, 0);
+    const char **target = NULL;
+
+    if (!strncmp(w, "2>>", 3)) {
+        target = &c->err; c->err_append = 1; w += 3;
+    } else if (!strncmp(w, "2>", 2)) {
+        target = &c->err; c->err_append = 0; w += 2;
+    } else if (!strncmp(w, ">>", 2)) {
+        target = &c->out; c->out_append = 1; w += 2;
+    } else if (*w == '>') {
+        target = &c->out; c->out_append = 0; w += 1;
+    } else if (*w == '<') {
+        target = &c->in; w += 1;
+    }
+
+    if (!target) {
+        add_word(b, w);
+        return;
+    }
+    if (!*w)
+        die(1, "batch: redirection without a file name (command %u)",
+                (unsigned)b->ncmds);
+    *target = w;
+}
+
+/* close the current command; drop it if it had no words at all */
+static void end_cmd(struct batch *b)
+{
+    struct batch_cmd *c = cur_cmd(b, 0);
+
+    if (c->word == b->nwords) {
+        if (c->in || c->out || c->err)
+            die(1, "batch: command %u has only redirections",
+                    (unsigned)b->ncmds);
+        b->ncmds--;
+        return;
+    }
+    add_word(b, NULL);
+}
+
+static void parse_lines(struct batch *b, char *p, char *end)
+{
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        if (!nl)
+            nl = end;
+        *nl = '\0';
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p && *p != '#') {
+            cur_cmd(b, 1);
+            while (*p) {
+                char *w = p;
+                while (*p && *p != ' ' && *p != '\t')
+                    p++;
+                if (*p)
+                    *p++ = '\0';
+                if (*w)
+                    cmd_word(b, w);
+            }
+            end_cmd(b);
+        }
+        p = nl + 1;
+    }
+}
+
+static void parse_nul(struct batch *b, char *p, char *end)
+{
+    int in_cmd = 0;
+
+    while (p < end) {
+        char *w = p;
+        p += strlen(p) + 1;
+        if (!*w) {
+            if (in_cmd)
+                end_cmd(b);
+            in_cmd = 0;
+            continue;
+        }
+        if (!in_cmd)
+            cur_cmd(b, 1);
+        in_cmd = 1;
+        cmd_word(b, w);
+    }
+    if (in_cmd)
+        end_cmd(b);
+}
+
+static char *read_list(int fd, size_t *len)
+{
+    size_t alloc = 0, n = 0;
+    char *buf = NULL;
+
+    for (;;) {
+        buf = grow(buf, &alloc, n + 4096, 1);
+        ssize_t r = read(fd, buf + n, alloc - n - 1);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            die_errno(1, "batch: read failed");
+        if (!r)
+            break;
+        n += r;
+    }
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+/*
+ * Parse "[-0] [-j <jobs>] [<file>]" and read the command list.
+ * Dies on bad options or an unreadable list.
+ */
+struct batch *batch_load(int argc, char *argv[])
+{
+    struct batch *b = calloc(1, sizeof(*b));
+    int nul = 0, fd = 0, i = 0;
+
+    if (!b)
+        die(2, "batch: out of memory");
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (!strcmp(argv[i], "-0"))
+            nul = 1;
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            char *rest;
+            long v = strtol(argv[++i], &rest, 10);
+            if (*rest || v < 0)
+                die(1, "batch: bad job count: %s", argv[i]);
+            b->jobs = v;
+        } else
+            die(1, "batch: unknown option: %s", argv[i]);
+    }
+    if (i + 1 < argc)
+        die(1, "batch: only one command list may be given");
+    if (i < argc && strcmp(argv[i], "-") &&
+            (fd = open(argv[i], O_RDONLY)) < 0)
+        die_errno(1, "batch: unable to open %s", argv[i]);
+
+    size_t len;
+    b->buf = read_list(fd, &len);
+    if (fd)
+        close(fd);
+
+    if (nul)
+        parse_nul(b, b->buf, b->buf + len);
+    else
+        parse_lines(b, b->buf, b->buf + len);
+
+    size_t k;
+    for (k = 0; k < b->ncmds; k++)
+        b->cmds[k].argv = b->words + b->cmds[k].word;
+    return b;
+}
+
+static int spawn_cmd(struct batch_cmd *c)
+{
+    posix_spawn_file_actions_t fa;
+    int r;
+
+    if ((r = posix_spawn_file_actions_init(&fa)))
+        return r;
+    r = posix_spawn_file_actions_addopen(&fa, 0,
+            c->in ? c->in : "/dev/null", O_RDONLY, 0);
+    if (!r && c->out)
+        r = posix_spawn_file_actions_addopen(&fa, 1, c->out,
+                O_WRONLY|O_CREAT|(c->out_append ? O_APPEND : O_TRUNC), 0666);
+    if (!r && c->err)
+        r = posix_spawn_file_actions_addopen(&fa, 2, c->err,
+                O_WRONLY|O_CREAT|(c->err_append ? O_APPEND : O_TRUNC), 0666);
+    if (!r)
+        r = posix_spawnp(&c->pid, c->argv[0], &fa, NULL, c->argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    return r;
+}
+
+static void report(size_t i, const struct batch_cmd *c)
+{
+    int st = c->status;
+
+    if (WIFEXITED(st))
+        msg("[%u] %s: exited %d", (unsigned)i + 1, c->argv[0], WEXITSTATUS(st));
+    else if (WIFSIGNALED(st))
+        msg("[%u] %s: terminated by signal %d", (unsigned)i + 1, c->argv[0],
+                WTERMSIG(st));
+}
+
+/*
+ * Spawn every command (at most b->jobs at once), wait for all of them
+ * and report each one's status. Returns 0 if every command exited 0,
+ * 1 otherwise.
+ */
+int batch_run(struct batch *b)
+{
+    size_t next = 0, done = 0, running = 0, i;
+    int failed = 0;
+
+    while (done < b->ncmds) {
+        while (next < b->ncmds && (!b->jobs || running < (size_t)b->jobs)) {
+            struct batch_cmd *c = &b->cmds[next++];
+            int err = spawn_cmd(c);
+            if (err) {
+                errno = err;
+                warn_errno("batch: unable to spawn %s", c->argv[0]);
+                c->pid = 0;
+                c->status = 127 << 8;
+                done++;
+            } else
+                running++;
+        }
+        if (!running)
+            continue;
+
+        int st;
+        pid_t p = waitpid(-1, &st, 0);
+        if (p < 0) {
+            if (errno == EINTR)
+                continue;
+            die_errno(3, "batch: waitpid failed");
+        }
+        for (i = 0; i < next; i++)
+            if (b->cmds[i].pid == p) {
+                b->cmds[i].pid = 0;
+                b->cmds[i].status = st;
+                running--;
+                done++;
+                break;
+            }
+    }
+
+    for (i = 0; i < b->ncmds; i++) {
+        report(i, &b->cmds[i]);
+        if (!WIFEXITED(b->cmds[i].status) || WEXITSTATUS(b->cmds[i].status))
+            failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,4 @@
+struct batch;
+
+struct batch *batch_load(int argc, char *argv[]);
+int batch_run(struct batch *b);
@@ -0,0 +1,1011 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "hash.h"
+#include "history.h"
+#include "msg.h"
+#include "normalize.h"
+#include "sanitize.h"
+#include "reattach.h"
+#include "stats.h"
+#include "user_path.h"
+#include "timing.h"
+
+#define UNUSED __attribute__ ((unused))
+
+static const char *wrapper = "./reattach-to-user-namespace";
+static const char *program = "true";
+
+static int parse_int(const char *str, const char *what)
+{
+    char *rest;
+    if (!(str && *str))
+        die(1, "%s requires a number", what);
+    errno = 0;
+    long v = strtol(str, &rest, 0);
+    if (errno || *rest || v <= 0)
+        die(1, "%s: bad number: %s", what, str);
+    return v;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* samples are sorted in place */
+static void report(const char *label, uint64_t *samples, int n)
+{
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    printf("%-24s n=%-6d p50=%8.1fus p99=%8.1fus max=%8.1fus\n", label, n,
+            samples[n/2] / 1e3,
+            samples[(n*99)/100 < n ? (n*99)/100 : n-1] / 1e3,
+            samples[n-1] / 1e3);
+    fflush(stdout);
+}
+
+/* fork, exec argv (via PATH), wait; returns elapsed ns */
+static uint64_t time_exec(char * const argv[])
+{
+    uint64_t t0 = now_ns();
+    pid_t p = fork();
+    if (p < 0)
+        die_errno(2, "fork failed");
+    if (!p) {
+        int fd = open("/dev/null", O_RDWR);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int st;
+    if (waitpid(p, &st, 0) < 0)
+        die_errno(2, "waitpid failed");
+    uint64_t t1 = now_ns();
+    if (!WIFEXITED(st) || WEXITSTATUS(st))
+        die(2, "%s exited abnormally (status 0x%x)", argv[0], st);
+    return t1 - t0;
+}
+
+static void set_wrapper(const char *opt)
+{
+    if (!(opt && *opt))
+        die(1, "wrapper requires a path");
+    wrapper = opt;
+}
+
+static void set_program(const char *opt)
+{
+    if (!(opt && *opt))
+        die(1, "program requires a path");
+    program = opt;
+}
+
+static void bench_startup(const char *opt)
+{
+    int i, n = parse_int(opt, "startup");
+    uint64_t *direct = malloc(n * sizeof(*direct));
+    uint64_t *wrapped = malloc(n * sizeof(*wrapped));
+    if (!direct || !wrapped)
+        die(2, "out of memory");
+
+    char * const dargv[] = { (char *)program, NULL };
+    char * const wargv[] = { (char *)wrapper, "-l", (char *)program, NULL };
+
+    /* interleave so drift in machine load hits both series alike */
+    for (i = 0; i < n; i++) {
+        direct[i] = time_exec(dargv);
+        wrapped[i] = time_exec(wargv);
+    }
+
+    report("direct exec", direct, n);
+    report("wrapper -l exec", wrapped, n);
+    printf("%-24s p50=%8.1fus\n", "wrapper overhead",
+            ((double)wrapped[n/2] - (double)direct[n/2]) / 1e3);
+
+    free(direct);
+    free(wrapped);
+}
+
+static void fill_text(char *buf, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+        buf[i] = (i % 64) == 63 ? '\n' : 'a' + i % 26;
+}
+
+/* a pane's worth of spawn through libreattach: spawn, wait; returns elapsed ns */
+static uint64_t time_lib_spawn(char * const argv[], const int fds[3])
+{
+    uint64_t t0 = now_ns();
+    pid_t p = reattach_spawn(argv, NULL, fds);
+    int st;
+
+    if (p < 0)
+        die_errno(2, "reattach_spawn %s failed", argv[0]);
+    if (waitpid(p, &st, 0) < 0)
+        die_errno(2, "waitpid failed");
+    uint64_t t1 = now_ns();
+    if (!WIFEXITED(st) || WEXITSTATUS(st))
+        die(2, "%s exited abnormally (status 0x%x)", argv[0], st);
+    return t1 - t0;
+}
+
+/* program started by an embedding host through libreattach vs. through the wrapper */
+static void bench_embed(const char *opt)
+{
+    int i, n = parse_int(opt, "embed");
+    uint64_t *lib = malloc(n * sizeof(*lib));
+    uint64_t *wrapped = malloc(n * sizeof(*wrapped));
+    int null = open("/dev/null", O_RDWR);
+    const int fds[3] = { -1, null, null };
+
+    if (!lib || !wrapped)
+        die(2, "out of memory");
+    if (null < 0)
+        die_errno(2, "unable to open /dev/null");
+
+    char * const largv[] = { (char *)program, NULL };
+    char * const wargv[] = { (char *)wrapper, (char *)program, NULL };
+
+    uint64_t t0 = now_ns();
+    if (reattach_init())
+        warn("reattach_init failed");
+    printf("%-24s %10.1fus\n", "reattach_init (once)", (now_ns() - t0) / 1e3);
+
+    for (i = 0; i < n; i++) {
+        lib[i] = time_lib_spawn(largv, fds);
+        wrapped[i] = time_exec(wargv);
+    }
+    report("reattach_spawn", lib, n);
+    report("wrapper exec", wrapped, n);
+    printf("%-24s p50=%8.1fus\n", "saved per spawn",
+            ((double)wrapped[n/2] - (double)lib[n/2]) / 1e3);
+
+    close(null);
+    free(lib);
+    free(wrapped);
+}
+
+/*
+ * program run through 1 to 5 nested wrappers, with the "already
+ * reattached" fast path and with REATTACH_FORCE_MOVE. With the stub
+ * backend, REATTACH_STUB_DELAY_US sets what each move costs.
+ */
+static void bench_nest(const char *opt)
+{
+    int d, i, n = parse_int(opt, "nest");
+    uint64_t *fast = malloc(n * sizeof(*fast));
+    uint64_t *forced = malloc(n * sizeof(*forced));
+    char *argv[7];
+    char label[32];
+
+    if (!fast || !forced)
+        die(2, "out of memory");
+    unsetenv("REATTACH_NAMESPACE");
+    for (d = 1; d <= 5; d++) {
+        for (i = 0; i < d; i++)
+            argv[i] = (char *)wrapper;
+        argv[d] = (char *)program;
+        argv[d + 1] = NULL;
+        for (i = 0; i < n; i++) {
+            unsetenv("REATTACH_FORCE_MOVE");
+            fast[i] = time_exec(argv);
+            setenv("REATTACH_FORCE_MOVE", "1", 1);
+            forced[i] = time_exec(argv);
+        }
+        unsetenv("REATTACH_FORCE_MOVE");
+        snprintf(label, sizeof(label), "depth %d, fast path", d);
+        report(label, fast, n);
+        snprintf(label, sizeof(label), "depth %d, always move", d);
+        report(label, forced, n);
+        printf("%-24s p50=%8.1fus\n", "saved",
+                ((double)forced[n/2] - (double)fast[n/2]) / 1e3);
+    }
+    free(fast);
+    free(forced);
+}
+
+/*
+ * pane start (wrapper exec of program) while every move stalls, with
+ * no deadline and with REATTACH_TIMEOUT_MS (default 50). With the stub
+ * backend the stall is REATTACH_STUB_DELAY_US (default 200ms).
+ */
+static void bench_stall(const char *opt)
+{
+    int i, n = parse_int(opt, "stall");
+    uint64_t *unbounded = malloc(n * sizeof(*unbounded));
+    uint64_t *bounded = malloc(n * sizeof(*bounded));
+    const char *ms = getenv("REATTACH_TIMEOUT_MS");
+    char *ms_copy = strdup(ms && *ms ? ms : "50");
+    char label[40];
+
+    if (!unbounded || !bounded || !ms_copy)
+        die(2, "out of memory");
+    setenv("REATTACH_STUB_DELAY_US", "200000", 0);
+    printf("stall: %sus per move\n", getenv("REATTACH_STUB_DELAY_US"));
+
+    char * const argv[] = { (char *)wrapper, (char *)program, NULL };
+    for (i = 0; i < n; i++) {
+        unsetenv("REATTACH_TIMEOUT_MS");
+        unbounded[i] = time_exec(argv);
+        setenv("REATTACH_TIMEOUT_MS", ms_copy, 1);
+        bounded[i] = time_exec(argv);
+    }
+    report("no deadline", unbounded, n);
+    snprintf(label, sizeof(label), "deadline %sms", ms_copy);
+    report(label, bounded, n);
+
+    free(ms_copy);
+    free(unbounded);
+    free(bounded);
+}
+
+/* a file of len bytes of text in $TMPDIR; returns its malloc'ed path */
+static char *make_payload(size_t len)
+{
+    const char *tmp = getenv("TMPDIR");
+    char *path = malloc(PATH_MAX), buf[64 * 1024];
+    int fd;
+
+    if (!path)
+        die(2, "out of memory");
+    snprintf(path, PATH_MAX, "%s/bench-payload.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if ((fd = mkstemp(path)) < 0)
+        die_errno(2, "unable to create %s", path);
+    fill_text(buf, sizeof(buf));
+    while (len) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n)
+            die_errno(2, "unable to write %s", path);
+        len -= n;
+    }
+    close(fd);
+    return path;
+}
+
+/* what one run of the wrapper on one end of a pipe cost */
+struct pipe_run {
+    uint64_t ns;
+    long syscr, syscw;  /* read/write calls; -1 where /proc/<pid>/io is missing */
+    long maxrss;        /* KiB */
+};
+
+/* the child's read and write syscall counts, read before it is reaped */
+static void proc_io(pid_t pid, struct pipe_run *r)
+{
+    char path[64], line[128];
+    FILE *f;
+
+    r->syscr = r->syscw = -1;
+#ifdef __linux__
+    siginfo_t si;
+    while (waitid(P_PID, pid, &si, WEXITED|WNOWAIT) < 0)
+        if (errno != EINTR)
+            die_errno(2, "waitid failed");
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if (!(f = fopen(path, "r")))
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %ld", &r->syscr);
+        sscanf(line, "syscw: %ld", &r->syscw);
+    }
+    fclose(f);
+#else
+    (void)pid; (void)path; (void)line; (void)f;
+#endif
+}
+
+/*
+ * Run "wrapper <mode>" with a pipe on its stdin (feed: we write len
+ * bytes of text into it) or its stdout (we drain it and expect len
+ * bytes back).
+ */
+static void run_pipe(const char *mode, int feed, size_t len, struct pipe_run *r)
+{
+    static char buf[1024 * 1024];
+    char * const argv[] = { (char *)wrapper, (char *)mode, NULL };
+    size_t total = 0;
+    struct rusage ru;
+    int p[2], st;
+
+    if (feed && buf[0] != 'a')
+        fill_text(buf, sizeof(buf));
+    if (pipe(p))
+        die_errno(2, "pipe failed");
+    uint64_t t0 = now_ns();
+    pid_t pid = fork();
+    if (pid < 0)
+        die_errno(2, "fork failed");
+    if (!pid) {
+        close(p[feed ? 1 : 0]);
+        dup2(p[feed ? 0 : 1], feed ? 0 : 1);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(p[feed ? 0 : 1]);
+    while (feed ? total < len : 1) {
+        size_t n = feed && len - total < sizeof(buf) ? len - total : sizeof(buf);
+        ssize_t k = feed ? write(p[1], buf, n) : read(p[0], buf, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            break;
+        total += k;
+    }
+    close(p[feed ? 1 : 0]);
+    proc_io(pid, r);
+    if (wait4(pid, &st, 0, &ru) < 0)
+        die_errno(2, "wait4 failed");
+    r->ns = now_ns() - t0;
+    r->maxrss = ru.ru_maxrss;
+#ifdef __APPLE__
+    r->maxrss /= 1024;
+#endif
+    if (!WIFEXITED(st) || WEXITSTATUS(st))
+        die(2, "%s %s exited abnormally (status 0x%x)", wrapper, mode, st);
+    if (total != len)
+        die(2, "%s %s %s %lu bytes, expected %lu", wrapper, mode,
+                feed ? "took" : "wrote", (unsigned long)total, (unsigned long)len);
+}
+
+/* run "wrapper --paste" into a pipe we drain; returns elapsed ns */
+static uint64_t time_paste(size_t len)
+{
+    struct pipe_run r;
+    run_pipe("--paste", 0, len, &r);
+    return r.ns;
+}
+
+/* 1 KiB, 16 KiB, ... up to max bytes (default 1 GiB) */
+static void bench_paste(const char *opt)
+{
+    size_t max = opt && *opt ? (size_t)parse_int(opt, "paste") : 1UL << 30;
+    size_t len;
+
+    for (len = 1024; len <= max; len *= 16) {
+        char *path = make_payload(len);
+        int i, n = len >= (64UL << 20) ? 3 : len >= (1UL << 20) ? 20 : 200;
+        uint64_t best = UINT64_MAX;
+
+        setenv("REATTACH_CLIPBOARD_FILE", path, 1);
+        for (i = 0; i < n; i++) {
+            uint64_t t = time_paste(len);
+            best = t < best ? t : best;
+        }
+        printf("paste %-12lu n=%-4d best=%10.1fus %9.1f MB/s\n",
+                (unsigned long)len, n, best / 1e3, len / (best / 1e9) / 1e6);
+        fflush(stdout);
+        unlink(path);
+        free(path);
+    }
+    unsetenv("REATTACH_CLIPBOARD_FILE");
+}
+
+static const char *json_path;
+
+static void set_json(const char *opt)
+{
+    if (!(opt && *opt))
+        die(1, "json requires a path");
+    json_path = opt;
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat sb;
+    return stat(path, &sb) ? -1 : sb.st_size;
+}
+
+/* the fastest of n runs, with that run's counts */
+static struct pipe_run best_of(const char *mode, int feed, size_t len, int n)
+{
+    struct pipe_run r, best = { UINT64_MAX, 0, 0, 0 };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        run_pipe(mode, feed, len, &r);
+        if (r.ns < best.ns)
+            best = r;
+    }
+    return best;
+}
+
+/*
+ * The copy-pipe round trip: 1 KiB, 1 MiB, 100 MiB and 1 GiB (those not
+ * above max) into "wrapper --copy" and back out of "wrapper --paste",
+ * with REATTACH_CLIPBOARD_FILE standing in for the pasteboard.
+ */
+static void bench_pipe(const char *opt)
+{
+    static const size_t sizes[] = { 1UL << 10, 1UL << 20, 100UL << 20, 1UL << 30 };
+    static const char * const modes[] = { "--copy", "--paste" };
+    size_t max = opt && *opt ? (size_t)parse_int(opt, "pipe") : 1UL << 30;
+    const char *tmp = getenv("TMPDIR");
+    char path[PATH_MAX];
+    FILE *json = NULL;
+    unsigned i;
+    int d, sep = 0;
+
+    snprintf(path, sizeof(path), "%s/bench-clipboard.%d",
+            tmp && *tmp ? tmp : "/tmp", (int)getpid());
+    setenv("REATTACH_CLIPBOARD_FILE", path, 1);
+    if (json_path && !(json = fopen(json_path, "w")))
+        die_errno(2, "unable to create %s", json_path);
+    if (json)
+        fprintf(json, "{\"wrapper\": \"%s\", \"runs\": [", wrapper);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes) && sizes[i] <= max; i++) {
+        size_t len = sizes[i];
+        int n = len >= (1UL << 30) ? 1 : len >= (100UL << 20) ? 3 : 20;
+
+        for (d = 0; d < 2; d++) {
+            struct pipe_run r = best_of(modes[d], d == 0, len, n);
+            double mbs = len / (r.ns / 1e9) / 1e6;
+
+            if (d == 0 && file_size(path) != (off_t)len)
+                die(2, "%s --copy left %ld bytes, expected %lu", wrapper,
+                        (long)file_size(path), (unsigned long)len);
+            printf("%-7s %-10lu n=%-3d best=%11.1fus %8.1f MB/s"
+                    " reads=%-6ld writes=%-6ld maxrss=%ld KiB\n",
+                    modes[d] + 2, (unsigned long)len, n, r.ns / 1e3, mbs,
+                    r.syscr, r.syscw, r.maxrss);
+            fflush(stdout);
+            if (json)
+                fprintf(json, "%s\n  {\"mode\": \"%s\", \"bytes\": %lu, \"runs\": %d,"
+                        " \"best_ns\": %llu, \"mb_per_s\": %.1f, \"read_calls\": %ld,"
+                        " \"write_calls\": %ld, \"max_rss_kib\": %ld}",
+                        sep++ ? "," : "", modes[d] + 2, (unsigned long)len, n,
+                        (unsigned long long)r.ns, mbs, r.syscr, r.syscw, r.maxrss);
+        }
+    }
+
+    if (json) {
+        fprintf(json, "\n]}\n");
+        if (fclose(json))
+            die_errno(2, "unable to write %s", json_path);
+    }
+    unlink(path);
+    unsetenv("REATTACH_CLIPBOARD_FILE");
+}
+
+/* hash a buffer of mib MiB, against memcpy of it as the memory-speed mark */
+static void bench_hash(const char *opt)
+{
+    size_t len = (size_t)parse_int(opt, "hash") << 20;
+    char *src = malloc(len), *dst = malloc(len);
+    uint64_t best_hash = UINT64_MAX, best_copy = UINT64_MAX, h = 0;
+    struct hash_state st;
+    int i;
+
+    if (!src || !dst)
+        die(2, "out of memory");
+    fill_text(src, len);
+    memset(dst, 0, len);
+
+    for (i = 0; i < 5; i++) {
+        uint64_t t0 = now_ns();
+        memcpy(dst, src, len);
+        uint64_t t1 = now_ns();
+        hash_init(&st);
+        hash_update(&st, src, len);
+        h ^= hash_final(&st);
+        uint64_t t2 = now_ns();
+        best_copy = t1 - t0 < best_copy ? t1 - t0 : best_copy;
+        best_hash = t2 - t1 < best_hash ? t2 - t1 : best_hash;
+    }
+    printf("%-24s %10.1f MB/s\n", "memcpy", len / (best_copy / 1e9) / 1e6);
+    printf("%-24s %10.1f MB/s (%.0f%% of memcpy; %016llx)\n", "hash",
+            len / (best_hash / 1e9) / 1e6, 100.0 * best_copy / best_hash,
+            (unsigned long long)h);
+    fflush(stdout);
+    free(src);
+    free(dst);
+}
+
+struct sink_buf {
+    char *mem;
+    size_t len, size;
+};
+
+static int to_buf(void *ctx, const char *data, size_t len)
+{
+    struct sink_buf *s = ctx;
+    if (len > s->size - s->len)
+        die(2, "normalize: output overflows the %lu bytes allowed",
+                (unsigned long)s->size);
+    memcpy(s->mem + s->len, data, len);
+    s->len += len;
+    return 0;
+}
+
+/* normalize src into dst (large enough), in pieces of at most chunk bytes */
+static size_t normalize_into(unsigned int flags, char *dst, size_t size,
+        const char *src, size_t len, size_t chunk)
+{
+    struct sink_buf s = { dst, 0, size };
+    struct normalize n;
+    size_t off;
+
+    if (normalize_init(&n, flags, to_buf, &s))
+        die(2, "normalize_init failed");
+    for (off = 0; off < len; off += chunk)
+        if (normalize_update(&n, src + off, len - off < chunk ? len - off : chunk))
+            die(2, "normalize_update failed");
+    if (normalize_final(&n))
+        die(2, "normalize_final failed");
+    normalize_free(&n);
+    return s.len;
+}
+
+/*
+ * --copy normalization throughput vs. memcpy, on clean text (nothing
+ * to change) and on text with something to change on every line. Each
+ * result is also checked against a run fed in small, odd-sized pieces.
+ */
+static void bench_normalize(const char *opt)
+{
+    static const struct {
+        const char *name;
+        unsigned int flags;
+    } sets[] = {
+        { "utf8", NORMALIZE_UTF8 },
+        { "crlf", NORMALIZE_CRLF },
+        { "trim", NORMALIZE_TRIM },
+        { "utf8,crlf,trim", NORMALIZE_UTF8 | NORMALIZE_CRLF | NORMALIZE_TRIM },
+    };
+    size_t len = (size_t)parse_int(opt, "normalize") << 20, i, j, k, out;
+    size_t check = len < (4 << 20) ? len : (4 << 20);
+    /* the dirty text grows by a few bytes per 8 KiB as bad bytes become U+FFFD */
+    size_t size = len + len / 1024;
+    char *src = malloc(len), *dst = malloc(size), *ref = malloc(size);
+    char label[48];
+    uint64_t best, best_copy = UINT64_MAX;
+
+    if (!src || !dst || !ref)
+        die(2, "out of memory");
+    memset(dst, 0, size);
+    printf("kernel: %s\n", normalize_kernel());
+    for (k = 0; k < 2; k++) {
+        fill_text(src, len);
+        if (k)  /* "...xyz \r\n", and an e-acute or a stray byte every 4 KiB */
+            for (i = 0; i + 64 <= len; i += 64) {
+                memcpy(src + i + 60, " \r\n", 3);
+                if (!(i % 4096))
+                    memcpy(src + i + 10, i % 8192 ? "\xc3\xa9" : "\xff\xfe", 2);
+            }
+        for (j = 0; j < 5 && !k; j++) {
+            uint64_t t0 = now_ns();
+            memcpy(dst, src, len);
+            uint64_t t = now_ns() - t0;
+            best_copy = t < best_copy ? t : best_copy;
+        }
+        if (!k)
+            printf("%-24s %10.1f MB/s\n", "memcpy", len / (best_copy / 1e9) / 1e6);
+
+        for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+            best = UINT64_MAX;
+            for (j = 0; j < 3; j++) {
+                uint64_t t0 = now_ns();
+                out = normalize_into(sets[i].flags, dst, size, src, len, 1 << 20);
+                uint64_t t = now_ns() - t0;
+                best = t < best ? t : best;
+            }
+            size_t ref_len = normalize_into(sets[i].flags, ref, size, src, check, 4093);
+            if (ref_len > out || memcmp(ref, dst, ref_len))
+                die(2, "normalize %s: output differs when fed in pieces", sets[i].name);
+            snprintf(label, sizeof(label), "%s %s", k ? "dirty" : "clean", sets[i].name);
+            printf("%-24s %10.1f MB/s (%.0f%% of memcpy; %lu bytes out)\n", label,
+                    len / (best / 1e9) / 1e6, 100.0 * best_copy / best,
+                    (unsigned long)out);
+            fflush(stdout);
+        }
+    }
+    free(src);
+    free(dst);
+    free(ref);
+}
+
+/* sanitize src into dst (large enough), in pieces of at most chunk bytes */
+static size_t sanitize_into(int mode, char *dst, size_t size, const char *src,
+        size_t len, size_t chunk)
+{
+    struct sink_buf s = { dst, 0, size };
+    struct sanitize san;
+    size_t off;
+
+    if (sanitize_init(&san, mode, to_buf, &s))
+        die(2, "sanitize_init failed");
+    for (off = 0; off < len; off += chunk)
+        if (sanitize_update(&san, src + off, len - off < chunk ? len - off : chunk))
+            die(2, "sanitize_update failed");
+    if (sanitize_final(&san))
+        die(2, "sanitize_final failed");
+    sanitize_free(&san);
+    return s.len;
+}
+
+/* what a hostile clipboard might hold, over and over */
+static const char *const hostile[] = {
+    "\x1b[201~", "\x1b]52;c;ZXZpbA==\x07", "\x1b]0;title\x1b\\", "\xc2\x9b" "201~",
+    "\xc2\x9d" "52;c;x\xc2\x9c", "\x1bP+q544e\x1b\\", "\x85", "\x1b[31m", "\x1b(B", "\x1b[?2004l",
+    "\x03", "\x7f", "\x1b\x1b[", "\x1b[1\x18", "\xc2\xa9", "\xc2", "\x1b]", "text ",
+    "\r\n", "\t",
+};
+
+/*
+ * --paste sanitizer throughput vs. memcpy, on clean text and on text
+ * with an escape sequence on every line; then a check that hostile
+ * input comes out the same whether it arrives whole or a byte at a
+ * time, and with no controls left in it.
+ */
+static void bench_sanitize(const char *opt)
+{
+    size_t len = (size_t)parse_int(opt, "sanitize") << 20, i, j, k, m, out;
+    char *src = malloc(len), *dst = malloc(len);
+    const size_t bad_len = 1 << 20;
+    char *bad = malloc(bad_len), *ref = malloc(bad_len * 4), *byte = malloc(bad_len * 4);
+    uint64_t best, best_copy = UINT64_MAX;
+    uint64_t seed = 1;
+    char label[48];
+
+    if (!src || !dst || !bad || !ref || !byte)
+        die(2, "out of memory");
+    memset(dst, 0, len);
+    printf("kernel: %s\n", sanitize_kernel());
+    for (k = 0; k < 2; k++) {
+        fill_text(src, len);
+        if (k)  /* every line colored: "\e[1m...\e[m\n" */
+            for (i = 0; i + 64 <= len; i += 64) {
+                memcpy(src + i, "\x1b[1m", 4);
+                memcpy(src + i + 60, "\x1b[m", 3);
+            }
+        for (j = 0; j < 5 && !k; j++) {
+            uint64_t t0 = now_ns();
+            memcpy(dst, src, len);
+            uint64_t t = now_ns() - t0;
+            best_copy = t < best_copy ? t : best_copy;
+        }
+        if (!k)
+            printf("%-24s %10.1f MB/s\n", "memcpy", len / (best_copy / 1e9) / 1e6);
+        for (m = SANITIZE_STRIP; m <= SANITIZE_ESCAPE; m++) {
+            best = UINT64_MAX;
+            for (j = 0; j < 3; j++) {
+                uint64_t t0 = now_ns();
+                /* escaping grows colored text; only the clean kind fits */
+                if (k && m == SANITIZE_ESCAPE)
+                    break;
+                out = sanitize_into(m, dst, len, src, len, 1 << 20);
+                uint64_t t = now_ns() - t0;
+                best = t < best ? t : best;
+            }
+            if (best == UINT64_MAX)
+                continue;
+            snprintf(label, sizeof(label), "%s %s", k ? "colored" : "clean",
+                    m == SANITIZE_STRIP ? "strip" : "escape");
+            printf("%-24s %10.1f MB/s (%.0f%% of memcpy; %lu bytes out)\n", label,
+                    len / (best / 1e9) / 1e6, 100.0 * best_copy / best,
+                    (unsigned long)out);
+            fflush(stdout);
+        }
+    }
+
+    for (i = 0; i < bad_len; ) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        const char *h = hostile[(seed >> 33) % (sizeof(hostile) / sizeof(hostile[0]))];
+        for (; *h && i < bad_len; h++)
+            bad[i++] = *h;
+    }
+    for (m = SANITIZE_STRIP; m <= SANITIZE_ESCAPE; m++) {
+        size_t whole = sanitize_into(m, ref, bad_len * 4, bad, bad_len, bad_len);
+        if (sanitize_into(m, byte, bad_len * 4, bad, bad_len, 1) != whole ||
+                memcmp(ref, byte, whole))
+            die(2, "sanitize: output differs when fed a byte at a time");
+        for (i = 0; i < whole; i++) {
+            unsigned char c = ref[i];
+            if ((c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == 0x7f ||
+                    (c == 0xc2 && (i + 1 == whole || (unsigned char)ref[i + 1] < 0xa0)))
+                die(2, "sanitize: control 0x%02x left at byte %lu", c, (unsigned long)i);
+        }
+        printf("%-24s %lu bytes in, %lu out, same in pieces, no controls\n",
+                m == SANITIZE_STRIP ? "hostile strip" : "hostile escape",
+                (unsigned long)bad_len, (unsigned long)whole);
+    }
+    free(src);
+    free(dst);
+    free(bad);
+    free(ref);
+    free(byte);
+}
+
+/* n counter updates (one launch's worth each), in a scratch per-user directory */
+static void bench_stats(const char *opt)
+{
+    int i, n = parse_int(opt, "stats");
+    const char *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX], file[PATH_MAX], *old = tmp ? strdup(tmp) : NULL;
+
+    snprintf(dir, sizeof(dir), "%s/bench-stats.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir))
+        die_errno(2, "unable to create %s", dir);
+    setenv("TMPDIR", dir, 1);
+
+    uint64_t t0 = now_ns();
+    stats_launch();     /* creates the file */
+    uint64_t t1 = now_ns();
+    stats_launch();     /* as every later run does */
+    uint64_t t2 = now_ns();
+    for (i = 0; i < n; i++) {
+        stats_backend(0, "bench", 1);
+        stats_exec();
+    }
+    uint64_t t3 = now_ns();
+    printf("%-24s %10.1fus\n", "stats file creation", (t1 - t0) / 1e3);
+    printf("%-24s %10.1fus\n", "stats map (once a run)", (t2 - t1) / 1e3);
+    printf("%-24s %10.1fns\n", "stats update (a launch)", (double)(t3 - t2) / n);
+    fflush(stdout);
+
+    if (user_path(file, sizeof(file), "stats"))
+        die(2, "no per-user directory in %s", dir);
+    unlink(file);
+    *strrchr(file, '/') = '\0';
+    rmdir(file);
+    rmdir(dir);
+    if (old)
+        setenv("TMPDIR", old, 1);
+    else
+        unsetenv("TMPDIR");
+    free(old);
+}
+
+/* a --copy of the ith bench_history entry: 64 to 4096 bytes of one letter */
+static size_t history_payload(int i, char *buf)
+{
+    size_t len = 64 + (i * 2654435761u) % 4033;
+    memset(buf, 'a' + i % 26, len);
+    return len;
+}
+
+/*
+ * n entries' worth of history, appended twice over (so both the slots
+ * and the ring wrap), then lookups of random entries, in a scratch
+ * per-user directory
+ */
+static void bench_history(const char *opt)
+{
+    int i, n = parse_int(opt, "history"), total = 2 * n;
+    const char *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX], file[PATH_MAX], *old = tmp ? strdup(tmp) : NULL;
+    char num[32], buf[4096], want[4096];
+    uint64_t *add = malloc(total * sizeof(*add)), *get = malloc(n * sizeof(*get));
+    struct history_entry e;
+
+    if (!add || !get)
+        die(2, "out of memory");
+    snprintf(dir, sizeof(dir), "%s/bench-history.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir))
+        die_errno(2, "unable to create %s", dir);
+    setenv("TMPDIR", dir, 1);
+    snprintf(num, sizeof(num), "%d", n);
+    setenv("REATTACH_COPY_HISTORY", "1", 1);
+    setenv("REATTACH_COPY_HISTORY_ENTRIES", num, 1);
+
+    for (i = 0; i < total; i++) {
+        size_t len = history_payload(i, buf);
+        uint64_t t0 = now_ns();
+        if (history_add(buf, len, i))
+            die(2, "history_add failed");
+        add[i] = now_ns() - t0;
+    }
+    srand(1);
+    for (i = 0; i < n; i++) {
+        int k = rand() % n;
+        uint64_t t0 = now_ns();
+        int r = history_get(k, &e, buf, sizeof(buf));
+        get[i] = now_ns() - t0;
+        if (r || e.hash != (uint64_t)(total - 1 - k) ||
+                e.len != history_payload(total - 1 - k, want) || memcmp(buf, want, e.len))
+            die(2, "history_get(%d) returned the wrong entry", k);
+    }
+    if (!history_get(n, &e, buf, sizeof(buf)))
+        die(2, "history_get(%d) found an entry that should be gone", n);
+    printf("%-24s %10.1fus\n", "history file creation", add[0] / 1e3);
+    report("history append", add + 1, total - 1);
+    report("history lookup", get, n);
+
+    if (user_path(file, sizeof(file), "copy-history"))
+        die(2, "no per-user directory in %s", dir);
+    unlink(file);
+    *strrchr(file, '/') = '\0';
+    rmdir(file);
+    rmdir(dir);
+    unsetenv("REATTACH_COPY_HISTORY");
+    unsetenv("REATTACH_COPY_HISTORY_ENTRIES");
+    if (old)
+        setenv("TMPDIR", old, 1);
+    else
+        unsetenv("TMPDIR");
+    free(old);
+    free(add);
+    free(get);
+}
+
+/* msg.c's vfmsg before the ring: malloc, %-escaping, vfprintf, fflush */
+static void old_vfmsg(FILE *f, const char *pre, const char *suf,
+        const char *fmt, va_list ap)
+{
+    int prelen = 0, fmtlen = 0, suflen = 0;
+    if (pre) prelen = strlen(pre);
+    if (fmt) fmtlen = strlen(fmt);
+    if (suf) suflen = strlen(suf);
+    char *newfmt = malloc(prelen*2 + fmtlen + 2 + suflen*2 + 2);
+    if (!newfmt)
+        goto finish;
+
+    char *newfmt_end = newfmt;
+    if (prelen)
+        while (*pre)
+            if ((*newfmt_end++ = *pre++) == '%')
+                *newfmt_end++ = '%';
+    if (fmtlen) {
+        strcpy(newfmt_end, fmt);
+        newfmt_end += fmtlen;
+    }
+    if (suflen) {
+        *newfmt_end++ = ':';
+        *newfmt_end++ = ' ';
+        while (*suf)
+            if ((*newfmt_end++ = *suf++) == '%')
+                *newfmt_end++ = '%';
+    }
+    *newfmt_end++ = '\n';
+    *newfmt_end++ = '\0';
+    fmt = newfmt;
+
+finish:
+    vfprintf(f, fmt, ap);
+    fflush(f);
+
+    if (newfmt)
+        free(newfmt);
+}
+
+static void old_warn(FILE *f, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    old_vfmsg(f, "warning: ", NULL, fmt, ap);
+    va_end(ap);
+}
+
+/* n warnings to /dev/null in a child (so each mode gets a fresh msg.c) */
+static void time_msgs(const char *label, const char *defer, int old, int n)
+{
+    pid_t p = fork();
+    int i, st;
+
+    if (p < 0)
+        die_errno(2, "fork failed");
+    if (!p) {
+        FILE *null = fopen("/dev/null", "w");
+        if (!null)
+            die_errno(2, "unable to open /dev/null");
+        if (defer)
+            setenv("REATTACH_LOG_DEFER", defer, 1);
+        else
+            unsetenv("REATTACH_LOG_DEFER");
+        msgout = null;
+
+        uint64_t t0 = now_ns();
+        for (i = 0; i < n; i++)
+            if (old)
+                old_warn(null, "message %d of %d from %s", i, n, label);
+            else
+                warn("message %d of %d from %s", i, n, label);
+        msg_flush();
+        uint64_t t1 = now_ns();
+
+        msgout = NULL;
+        printf("%-24s n=%-8d %12.0f msgs/s\n", label, n, n / ((t1 - t0) / 1e9));
+        fflush(stdout);
+        _exit(0);
+    }
+    if (waitpid(p, &st, 0) < 0 || !WIFEXITED(st) || WEXITSTATUS(st))
+        die(2, "%s benchmark failed", label);
+}
+
+static void bench_msgs(const char *opt)
+{
+    int n = parse_int(opt, "msgs");
+
+    time_msgs("stdio (old vfmsg)", NULL, 1, n);
+    time_msgs("ring, immediate", NULL, 0, n);
+    time_msgs("ring, deferred", "1", 0, n);
+}
+
+typedef void cmd_func(const char *opt);
+struct cmd {
+    cmd_func * const func;
+    const char * const str;
+    const char * const desc;
+};
+
+static cmd_func help;
+
+static struct cmd all_cmds[] = {
+    { set_wrapper,    "wrapper", "=<path>  wrapper to time (default ./reattach-to-user-namespace)" },
+    { set_program,    "program", "=<prog>  program exec'd by both series (default true)" },
+    { bench_startup,  "startup", "=<runs>  direct exec vs. wrapper -l exec latency" },
+    { bench_embed,    "embed",   "=<runs>  libreattach spawn vs. a spawn through the wrapper" },
+    { bench_nest,     "nest",    "=<runs>  1-5 nested wrappers, skipping vs. repeating the move" },
+    { bench_stall,    "stall",   "=<runs>  wrapper exec with stalling moves, with and without a deadline" },
+    { bench_paste,    "paste",   "=<max>   wrapper --paste throughput, 1 KiB to max bytes (default 1 GiB)" },
+    { bench_pipe,     "pipe",    "=<max>   --copy then --paste through pipes: 1 KiB, 1 MiB, 100 MiB, 1 GiB" },
+    { set_json,       "json",    "=<path>  also write later pipe results there as JSON" },
+    { bench_hash,     "hash",    "=<MiB>   copy dedup hash throughput vs. memcpy" },
+    { bench_normalize, "normalize", "=<MiB> --copy normalization throughput vs. memcpy" },
+    { bench_sanitize, "sanitize", "=<MiB>  --paste sanitizer throughput vs. memcpy, and hostile input" },
+    { bench_stats,    "stats",   "=<count> cost of the per-user launch counters" },
+    { bench_history,  "history", "=<entries> copy history appends and lookups, slots and ring wrapped" },
+    { bench_msgs,     "msgs",    "=<count> old vs. ring-buffered msg.c, messages per second" },
+    { help,           "help",    "         show this help text" },
+    { NULL, "", "" }
+};
+
+static void help(const char *opt UNUSED)
+{
+    struct cmd *c;
+    int w, cmd_width = 0;
+    for (c = all_cmds; c->func; c++) {
+        w = strlen(c->str);
+        cmd_width = w > cmd_width ? w : cmd_width;
+    }
+    for (c = all_cmds; c->func; c++)
+        msg("    %*s%s", cmd_width, c->str, c->desc);
+}
+
+static void run_cmd(const char *cmd)
+{
+    const char *opt = strchr(cmd, '=');
+    size_t cmd_len = opt ? (size_t)(opt-cmd) : strlen(cmd);
+    if (!cmd_len)
+        die(1, "no command in argument: %s", cmd);
+    if (opt)
+        opt++;
+    struct cmd *c;
+    for (c = all_cmds; c->func; c++)
+        if (!strncmp(cmd, c->str, cmd_len) &&
+                c->str[cmd_len] == '\0') {
+            c->func(opt);
+            return;
+        }
+    die(1, "unknown command: %s (try help)", cmd);
+}
+
+int main(int argc, const char * const argv[])
+{
+    if (argc < 2)
+        die(1, "usage: %s <command>...\n\n"
+                "    Run the given benchmarks.\n"
+                "    Run \"%s help\" for command list.\n",
+                argv[0], argv[0]);
+
+    const char * const * cmds = argv+1;
+    while (*cmds)
+        run_cmd(*cmds++);
+
+    return 0;
+}
@@ -0,0 +1,441 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "msg.h"
+#include "broker.h"
+#include "user_path.h"
+
+/*
+ * A broker is a long-lived wrapper process that has already reattached
+ * to the per-user namespace. Clients hand it everything a launch needs
+ * (cwd, program, argv, environment and fds 0-2) in one message; a
+ * handler process forked by the broker spawns the program, reports its
+ * pid and, later, its wait status back to the client.
+ *
+ * Request, client to broker (fds 0-2 ride along as SCM_RIGHTS):
+ *
+ *     struct broker_request
+ *     len bytes: cwd NUL file NUL argv[0] NUL ... env[0] NUL ...
+ *
+ * Replies, broker to client: int32 pid, then int32 wait status.
+ *
+ * REATTACH_BROKER_SOCKET can put the socket where others can reach it,
+ * so a connection from any uid but ours is dropped unread.
+ */
+
+#define BROKER_MAGIC 0x72747562 /* "rtub" */
+#define BROKER_MAX_PAYLOAD (16 * 1024 * 1024)
+
+struct broker_request {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;
+};
+
+extern char **environ;
+
+static int broker_path(struct sockaddr_un *sa)
+{
+    const char *env = getenv("REATTACH_BROKER_SOCKET");
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (env && *env) {
+        if (strlen(env) >= sizeof(sa->sun_path)) {
+            warn("REATTACH_BROKER_SOCKET is too long");
+            return -1;
+        }
+        strcpy(sa->sun_path, env);
+        return 0;
+    }
+    return user_path(sa->sun_path, sizeof(sa->sun_path), "broker.sock");
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* send every iov; ctl (if any) goes with the first sendmsg */
+static int send_iov(int fd, struct iovec *iov, int n, void *ctl, size_t ctllen)
+{
+    while (n) {
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = n > IOV_MAX ? IOV_MAX : n;
+        mh.msg_control = ctl;
+        mh.msg_controllen = ctllen;
+
+        ssize_t r = sendmsg(fd, &mh, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        ctl = NULL;
+        ctllen = 0;
+
+        while (n && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Client side.
+ */
+
+static volatile sig_atomic_t child_pid;
+
+static void forward_signal(int sig)
+{
+    if (child_pid > 0)
+        kill(child_pid, sig);
+}
+
+int broker_spawn(const char *file, char * const argv[])
+{
+    static const int fwd_sigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 };
+    struct sockaddr_un sa;
+    int i, fd;
+
+    /*
+     * The broker's children can not take over our controlling
+     * terminal, so interactive (tty) launches stay in-process where
+     * job control works.
+     */
+    if (isatty(0))
+        return -1;
+    for (i = 0; i < 3; i++)
+        if (fcntl(i, F_GETFD) < 0)
+            return -1;
+
+    if (broker_path(&sa))
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+        close(fd);
+        return -1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, "/");
+
+    int argc = 0, envc = 0;
+    while (argv[argc])
+        argc++;
+    while (environ[envc])
+        envc++;
+
+    struct broker_request req;
+    struct iovec iov[3 + argc + envc];
+    int n = 0;
+    req.magic = BROKER_MAGIC;
+    req.argc = argc;
+    req.envc = envc;
+    req.len = 0;
+    iov[n].iov_base = &req;
+    iov[n++].iov_len = sizeof(req);
+    iov[n].iov_base = cwd;
+    iov[n++].iov_len = strlen(cwd) + 1;
+    iov[n].iov_base = (char *)file;
+    iov[n++].iov_len = strlen(file) + 1;
+    for (i = 0; i < argc; i++) {
+        iov[n].iov_base = argv[i];
+        iov[n++].iov_len = strlen(argv[i]) + 1;
+    }
+    for (i = 0; i < envc; i++) {
+        iov[n].iov_base = environ[i];
+        iov[n++].iov_len = strlen(environ[i]) + 1;
+    }
+    for (i = 1; i < n; i++)
+        req.len += iov[i].iov_len;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.hdr.cmsg_len = CMSG_LEN(3 * sizeof(int));
+    ctl.hdr.cmsg_level = SOL_SOCKET;
+    ctl.hdr.cmsg_type = SCM_RIGHTS;
+    for (i = 0; i < 3; i++)
+        ((int *)CMSG_DATA(&ctl.hdr))[i] = i;
+
+    int32_t pid, status;
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    int sent = send_iov(fd, iov, n, &ctl, sizeof(ctl.buf));
+    signal(SIGPIPE, old_pipe);
+    if (sent || read_all(fd, &pid, sizeof(pid))) {
+        /* nothing was started; fall back to reattaching ourselves */
+        warn("broker did not accept the request");
+        close(fd);
+        return -1;
+    }
+    if (pid < 0) {
+        errno = -pid;
+        die_errno(3, "broker: exec of %s failed", file);
+    }
+
+    child_pid = pid;
+    for (i = 0; i < (int)(sizeof(fwd_sigs)/sizeof(*fwd_sigs)); i++)
+        signal(fwd_sigs[i], forward_signal);
+
+    if (read_all(fd, &status, sizeof(status)))
+        die(3, "lost connection to broker (pid %d still running)", (int)pid);
+
+    if (WIFEXITED(status))
+        exit(WEXITSTATUS(status));
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        raise(WTERMSIG(status));
+        exit(128 + WTERMSIG(status));
+    }
+    exit(3);
+}
+
+/*
+ * Broker side.
+ */
+
+static int recv_request(int fd, struct broker_request *req, int fds[3])
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { req, sizeof(*req) };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+
+    ssize_t r;
+    while ((r = recvmsg(fd, &mh, 0)) < 0 && errno == EINTR)
+        ;
+    if (r <= 0)
+        return -1;
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+            c->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(c), 3 * sizeof(int));
+
+    if ((size_t)r < sizeof(*req) &&
+            read_all(fd, (char *)req + r, sizeof(*req) - r))
+        return -1;
+    /* cwd, file and every string of argv and env each take at least a NUL */
+    if (req->magic != BROKER_MAGIC || req->argc < 1 ||
+            req->len > BROKER_MAX_PAYLOAD ||
+            (uint64_t)req->argc + req->envc + 2 > req->len)
+        return -1;
+    return 0;
+}
+
+/* whether the other end of the connection runs as our uid */
+static int peer_is_us(int fd)
+{
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred))
+        return 0;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid))
+        return 0;
+    return uid == getuid();
+#endif
+}
+
+/* runs in a process forked for one connection; never returns */
+static void handle(int fd)
+{
+    struct broker_request req;
+    int i, fds[3];
+
+    signal(SIGCHLD, SIG_DFL);
+    if (recv_request(fd, &req, fds))
+        _exit(1);
+
+    char *payload = malloc(req.len + 1);
+    char **args = malloc(((size_t)req.argc + req.envc + 2) * sizeof(*args));
+    if (!payload || !args || read_all(fd, payload, req.len))
+        _exit(1);
+    payload[req.len] = '\0';
+
+    /* split into cwd, file, argv (NULL), env (NULL) */
+    char *p = payload, *end = payload + req.len;
+    char *strs[2];
+    size_t k, want = 2 + (size_t)req.argc + req.envc;
+    for (k = 0; k < want; k++) {
+        if (p >= end)
+            _exit(1);
+        if (k < 2)
+            strs[k] = p;
+        else if (k < 2 + req.argc)
+            args[k-2] = p;
+        else
+            args[k-1] = p;
+        p += strlen(p) + 1;
+    }
+    char **cargv = args, **cenv = args + req.argc + 1;
+    cargv[req.argc] = NULL;
+    cenv[req.envc] = NULL;
+
+    int errpipe[2];
+    if (pipe(errpipe) || fcntl(errpipe[1], F_SETFD, FD_CLOEXEC))
+        _exit(1);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        _exit(1);
+    if (!pid) {
+        int err;
+        close(errpipe[0]);
+        signal(SIGPIPE, SIG_DFL);
+        setsid();
+        for (i = 0; i < 3; i++)
+            if (dup2(fds[i], i) < 0)
+                goto failed;
+        for (i = 0; i < 3; i++)
+            if (fds[i] > 2)
+                close(fds[i]);
+        close(fd);
+        if (chdir(strs[0]))
+            goto failed;
+        environ = cenv;
+        execvp(strs[1], cargv);
+failed:
+        err = errno;
+        write_all(errpipe[1], &err, sizeof(err));
+        _exit(127);
+    }
+    close(errpipe[1]);
+    for (i = 0; i < 3; i++)
+        close(fds[i]);
+
+    int32_t reply = pid;
+    int err;
+    if (read_all(errpipe[0], &err, sizeof(err)) == 0) {
+        reply = -err;
+        waitpid(pid, NULL, 0);
+    }
+    if (write_all(fd, &reply, sizeof(reply)) || reply < 0)
+        _exit(0);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            _exit(1);
+    reply = status;
+    write_all(fd, &reply, sizeof(reply));
+    _exit(0);
+}
+
+void broker_serve(void)
+{
+    struct sockaddr_un sa;
+    int fd, probe;
+
+    if (broker_path(&sa))
+        die(3, "broker: no usable socket path");
+
+    /* only replace a socket that nobody is listening on */
+    if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        die_errno(3, "broker: socket failed");
+    if (!connect(probe, (struct sockaddr *)&sa, sizeof(sa)))
+        die(3, "broker: already running on %s", sa.sun_path);
+    close(probe);
+    unlink(sa.sun_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        die_errno(3, "broker: socket failed");
+    mode_t old = umask(077);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)))
+        die_errno(3, "broker: bind to %s failed", sa.sun_path);
+    umask(old);
+    if (listen(fd, 64))
+        die_errno(3, "broker: listen failed");
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    /* handlers are never waited for */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        int c = accept(fd, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die_errno(3, "broker: accept failed");
+        }
+        if (!peer_is_us(c)) {
+            warn("broker: dropping a connection from another user");
+            close(c);
+            continue;
+        }
+        msg_flush();
+        pid_t p = fork();
+        if (p < 0)
+            warn_errno("broker: fork failed");
+        else if (!p) {
+            close(fd);
+            handle(c);
+        }
+        close(c);
+    }
+}
@@ -0,0 +1,2 @@
+int broker_spawn(const char *file, char * const argv[]);
+void broker_serve(void) __attribute__((noreturn));
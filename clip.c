@@ -0,0 +1,429 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/errno.h>
+
+#ifdef __APPLE__
+#include <dlfcn.h>
+#include <bsm/audit.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#endif
+
+#include "msg.h"
+#include "clip.h"
+#include "hash.h"
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* copy len bytes of from (a regular file) to fd through a small buffer */
+static int copy_fd(int fd, int from, size_t len)
+{
+    char buf[64 * 1024];
+    off_t off = 0;
+
+    while (len) {
+        ssize_t r = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0 || write_all(fd, buf, r))
+            return -1;
+        off += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* the stand-in change count: REATTACH_CLIPBOARD_COUNT's number, or -1 */
+static long file_change_count(void)
+{
+    const char *path = getenv("REATTACH_CLIPBOARD_COUNT");
+    char buf[32];
+    ssize_t n;
+    int fd;
+
+    if (!(path && *path) || (fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return strtol(buf, NULL, 10);
+}
+
+/* advance the stand-in change count (if there is one), as the pasteboard would */
+static void count_bump(void)
+{
+    const char *path = getenv("REATTACH_CLIPBOARD_COUNT");
+    char buf[32];
+    int fd, n;
+
+    if (!(path && *path))
+        return;
+    n = snprintf(buf, sizeof(buf), "%ld\n", file_change_count() + 1);
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0 ||
+            write_all(fd, buf, n))
+        warn_errno("unable to update %s", path);
+    if (fd >= 0)
+        close(fd);
+}
+
+/*
+ * File sink: the whole payload is written next to the file and renamed
+ * over it, so a reader sees either the old or the new contents.
+ */
+static int file_write(const void *data, int from, size_t len)
+{
+    const char *path = getenv("REATTACH_CLIPBOARD_FILE");
+    char tmp[PATH_MAX];
+    int fd, n;
+
+    n = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        warn("REATTACH_CLIPBOARD_FILE is too long");
+        return -1;
+    }
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+        warn_errno("unable to create %s", tmp);
+        return -1;
+    }
+    if ((data ? write_all(fd, data, len) : copy_fd(fd, from, len)) ||
+            close(fd)) {
+        warn_errno("unable to write %s", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path)) {
+        warn_errno("unable to rename %s to %s", tmp, path);
+        unlink(tmp);
+        return -1;
+    }
+    count_bump();
+    return 0;
+}
+
+static int file_put(const void *data, size_t len)
+{
+    return file_write(data, -1, len);
+}
+
+static int file_put_fd(int fd, size_t len)
+{
+    return file_write(NULL, fd, len);
+}
+
+static const struct clip_sink file_sink = { "file", file_put, file_put_fd };
+
+static int file_open(void)
+{
+    const char *path = getenv("REATTACH_CLIPBOARD_FILE");
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        warn_errno("unable to open %s", path);
+    return fd;
+}
+
+static const struct clip_source file_source = { "file", file_open, NULL, file_change_count };
+
+#ifdef __APPLE__
+/*
+ * Pasteboard sink and source: the Carbon Pasteboard calls (plain C,
+ * unlike NSPasteboard). ApplicationServices is only loaded when the
+ * pasteboard is used, so ordinary launches do not pay for linking it.
+ */
+typedef const void *cf_ref;
+typedef cf_ref (*ft_CFStringCreateWithCString)(cf_ref, const char *, uint32_t);
+typedef cf_ref (*ft_CFDataCreateWithBytesNoCopy)(cf_ref, const void *, long, cf_ref);
+typedef long (*ft_CFDataGetLength)(cf_ref);
+typedef const void *(*ft_CFDataGetBytePtr)(cf_ref);
+typedef void (*ft_CFRelease)(cf_ref);
+typedef int32_t (*ft_PasteboardCreate)(cf_ref, void **);
+typedef uint32_t (*ft_PasteboardSynchronize)(void *);
+typedef int32_t (*ft_PasteboardClear)(void *);
+typedef int32_t (*ft_PasteboardPutItemFlavor)(void *, void *, cf_ref, cf_ref, uint32_t);
+typedef int32_t (*ft_PasteboardGetItemCount)(void *, unsigned long *);
+typedef int32_t (*ft_PasteboardGetItemIdentifier)(void *, unsigned long, void **);
+typedef int32_t (*ft_PasteboardCopyItemFlavorData)(void *, void *, cf_ref, cf_ref *);
+
+#define kCFStringEncodingUTF8 0x08000100
+
+enum {
+    PB_STRING, PB_DATA_NOCOPY, PB_DATA_LENGTH, PB_DATA_BYTES, PB_RELEASE,
+    PB_ALLOCATOR_NULL, PB_CREATE, PB_SYNCHRONIZE, PB_CLEAR, PB_PUT,
+    PB_ITEM_COUNT, PB_ITEM_ID, PB_COPY_DATA, PB_NSYMS
+};
+
+static const char * const pb_syms[PB_NSYMS] = {
+    "CFStringCreateWithCString", "CFDataCreateWithBytesNoCopy",
+    "CFDataGetLength", "CFDataGetBytePtr", "CFRelease", "kCFAllocatorNull",
+    "PasteboardCreate", "PasteboardSynchronize", "PasteboardClear",
+    "PasteboardPutItemFlavor", "PasteboardGetItemCount",
+    "PasteboardGetItemIdentifier", "PasteboardCopyItemFlavorData"
+};
+
+static void *pb_fn[PB_NSYMS];
+
+static int pb_load(void)
+{
+    static const char fw[] =
+        "/System/Library/Frameworks/ApplicationServices.framework/ApplicationServices";
+    void *lib;
+    int i;
+
+    if (pb_fn[0])
+        return 0;
+    if (!(lib = dlopen(fw, RTLD_LAZY|RTLD_LOCAL))) {
+        warn("unable to load ApplicationServices: %s", dlerror());
+        return -1;
+    }
+    for (i = 0; i < PB_NSYMS; i++)
+        if (!(pb_fn[i] = dlsym(lib, pb_syms[i]))) {
+            warn("unable to find %s: %s", pb_syms[i], dlerror());
+            pb_fn[0] = NULL;
+            return -1;
+        }
+    return 0;
+}
+
+/* the clipboard and the flavor we use, as CFStrings */
+static int pb_open(void **pb, cf_ref *flavor)
+{
+    ft_CFStringCreateWithCString str = (ft_CFStringCreateWithCString)pb_fn[PB_STRING];
+    ft_CFRelease release = (ft_CFRelease)pb_fn[PB_RELEASE];
+    cf_ref name;
+
+    *pb = NULL;
+    name = str(NULL, "com.apple.pasteboard.clipboard", kCFStringEncodingUTF8);
+    *flavor = str(NULL, "public.utf8-plain-text", kCFStringEncodingUTF8);
+    if (!name || !*flavor)
+        warn("unable to create pasteboard names");
+    else if (((ft_PasteboardCreate)pb_fn[PB_CREATE])(name, pb))
+        warn("PasteboardCreate failed");
+    if (name)
+        release(name);
+    if (*pb)
+        return 0;
+    if (*flavor)
+        release(*flavor);
+    return -1;
+}
+
+static int pasteboard_put(const void *data, size_t len)
+{
+    ft_CFRelease release;
+    cf_ref flavor, cfdata;
+    void *pb;
+    int r = -1;
+
+    if (pb_load() || pb_open(&pb, &flavor))
+        return -1;
+    release = (ft_CFRelease)pb_fn[PB_RELEASE];
+
+    cfdata = ((ft_CFDataCreateWithBytesNoCopy)pb_fn[PB_DATA_NOCOPY])(NULL,
+            data, len, *(cf_ref *)pb_fn[PB_ALLOCATOR_NULL]);
+    if (!cfdata)
+        warn("unable to create pasteboard data");
+    else if (((ft_PasteboardClear)pb_fn[PB_CLEAR])(pb))
+        warn("PasteboardClear failed");
+    else if (((ft_PasteboardPutItemFlavor)pb_fn[PB_PUT])(pb, (void *)1, flavor, cfdata, 0))
+        warn("PasteboardPutItemFlavor failed");
+    else
+        r = 0;
+
+    if (cfdata) release(cfdata);
+    release(flavor);
+    release(pb);
+    return r;
+}
+
+/* text of the first item that has any; the CFData is kept until the next get */
+static const void *pasteboard_get(size_t *len)
+{
+    static cf_ref cfdata;
+    ft_CFRelease release;
+    unsigned long i, n = 0;
+    cf_ref flavor;
+    void *pb;
+
+    if (pb_load() || pb_open(&pb, &flavor))
+        return NULL;
+    release = (ft_CFRelease)pb_fn[PB_RELEASE];
+    if (cfdata) {
+        release(cfdata);
+        cfdata = NULL;
+    }
+
+    ((ft_PasteboardSynchronize)pb_fn[PB_SYNCHRONIZE])(pb);
+    if (((ft_PasteboardGetItemCount)pb_fn[PB_ITEM_COUNT])(pb, &n))
+        warn("PasteboardGetItemCount failed");
+    for (i = 1; i <= n && !cfdata; i++) {
+        void *item;
+        if (((ft_PasteboardGetItemIdentifier)pb_fn[PB_ITEM_ID])(pb, i, &item))
+            continue;
+        if (((ft_PasteboardCopyItemFlavorData)pb_fn[PB_COPY_DATA])(pb, item,
+                    flavor, &cfdata))
+            cfdata = NULL;
+    }
+    release(flavor);
+    release(pb);
+
+    if (!cfdata) {
+        *len = 0;
+        return "";
+    }
+    *len = ((ft_CFDataGetLength)pb_fn[PB_DATA_LENGTH])(cfdata);
+    return ((ft_CFDataGetBytePtr)pb_fn[PB_DATA_BYTES])(cfdata);
+}
+
+/*
+ * The Carbon calls have no change count that lasts between processes,
+ * so ask NSPasteboard for its changeCount through the Objective-C
+ * runtime. AppKit is loaded for this alone; it is still far cheaper
+ * than copying the contents out. The lookups (AppKit, objc_msgSend,
+ * the general pasteboard and the selector) are done once per process;
+ * a --copy asks twice, and a later call is only the message send.
+ */
+typedef void *(*ft_objc_getClass)(const char *);
+typedef void *(*ft_sel_registerName)(const char *);
+typedef void *(*ft_msg_id)(void *, void *);
+typedef long (*ft_msg_long)(void *, void *);
+
+static void *cc_send, *cc_pb, *cc_sel;
+static int cc_failed;
+
+static int cc_load(void)
+{
+    static const char appkit[] = "/System/Library/Frameworks/AppKit.framework/AppKit";
+    void *lib, *get_class, *sel, *cls;
+
+    if (cc_pb)
+        return 0;
+    if (cc_failed)
+        return -1;
+    cc_failed = 1;
+    if (!(lib = dlopen(appkit, RTLD_LAZY|RTLD_LOCAL)) ||
+            !(get_class = dlsym(lib, "objc_getClass")) ||
+            !(sel = dlsym(lib, "sel_registerName")) ||
+            !(cc_send = dlsym(lib, "objc_msgSend")))
+        return -1;
+    if (!(cls = ((ft_objc_getClass)get_class)("NSPasteboard")) ||
+            !(cc_sel = ((ft_sel_registerName)sel)("changeCount")))
+        return -1;
+    cc_pb = ((ft_msg_id)cc_send)(cls, ((ft_sel_registerName)sel)("generalPasteboard"));
+    if (!cc_pb)
+        return -1;
+    cc_failed = 0;
+    return 0;
+}
+
+static long pasteboard_change_count(void)
+{
+    if (cc_load())
+        return -1;
+    return ((ft_msg_long)cc_send)(cc_pb, cc_sel);
+}
+
+static const struct clip_sink pasteboard_sink = { "pasteboard", pasteboard_put, NULL };
+static const struct clip_source pasteboard_source = { "pasteboard", NULL, pasteboard_get,
+    pasteboard_change_count };
+#endif
+
+const struct clip_sink *clip_sink(void)
+{
+    const char *file = getenv("REATTACH_CLIPBOARD_FILE");
+
+    if (file && *file)
+        return &file_sink;
+#ifdef __APPLE__
+    return &pasteboard_sink;
+#else
+    warn("no pasteboard here; set REATTACH_CLIPBOARD_FILE");
+    return NULL;
+#endif
+}
+
+/* hash str (with its terminator, so "ab" + "c" differs from "a" + "bc") */
+static void hash_str(struct hash_state *h, const char *str)
+{
+    if (str)
+        hash_update(h, str, strlen(str) + 1);
+    else
+        hash_update(h, "", 1);
+}
+
+/*
+ * The boot (and on Darwin the login session) the counts belong to:
+ * the pasteboard server, and its count, start over with both.
+ */
+static void hash_boot(struct hash_state *h)
+{
+#ifdef __APPLE__
+    int mib[2] = { CTL_KERN, KERN_BOOTTIME };
+    struct timeval boot;
+    auditinfo_addr_t ai;
+    size_t len = sizeof(boot);
+
+    if (!sysctl(mib, 2, &boot, &len, NULL, 0))
+        hash_update(h, &boot, sizeof(boot));
+    if (!getaudit_addr(&ai, sizeof(ai)))
+        hash_update(h, &ai.ai_asid, sizeof(ai.ai_asid));
+#else
+    char buf[64];
+    ssize_t n = 0;
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+
+    if (fd >= 0) {
+        n = read(fd, buf, sizeof(buf));
+        close(fd);
+    }
+    if (n > 0)
+        hash_update(h, buf, n);
+#endif
+}
+
+uint64_t clip_generation(const struct clip_source *src)
+{
+    struct hash_state h;
+
+    hash_init(&h);
+    hash_boot(&h);
+    hash_str(&h, src->name);
+    if (src == &file_source) {
+        hash_str(&h, getenv("REATTACH_CLIPBOARD_FILE"));
+        hash_str(&h, getenv("REATTACH_CLIPBOARD_COUNT"));
+    }
+    return hash_final(&h);
+}
+
+const struct clip_source *clip_source(void)
+{
+    const char *file = getenv("REATTACH_CLIPBOARD_FILE");
+
+    if (file && *file)
+        return &file_source;
+#ifdef __APPLE__
+    return &pasteboard_source;
+#else
+    warn("no pasteboard here; set REATTACH_CLIPBOARD_FILE");
+    return NULL;
+#endif
+}
@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Where --copy puts the data it read, and where --paste gets it.
+ *
+ * REATTACH_CLIPBOARD_FILE names a plain file to use instead of the
+ * pasteboard (the only choice off of Darwin). REATTACH_CLIPBOARD_COUNT
+ * may name a second file holding that clipboard's change count (a
+ * decimal number); the file sink bumps it on every put.
+ */
+struct clip_sink {
+    const char *name;
+    int (*put)(const void *data, size_t len);
+    /* optional: take len bytes from the start of fd, a regular file */
+    int (*put_fd)(int fd, size_t len);
+};
+
+const struct clip_sink *clip_sink(void);
+
+/* exactly one of open and get is set */
+struct clip_source {
+    const char *name;
+    int (*open)(void);                  /* an fd to read the contents from */
+    const void *(*get)(size_t *len);    /* the contents, valid until the next get */
+    /* optional: a number that changes whenever the contents do; -1 if unknown */
+    long (*change_count)(void);
+};
+
+const struct clip_source *clip_source(void);
+
+/*
+ * Which counter src's change counts come from: a count restarts with
+ * a reboot, a logout or a new pasteboard server, and the file source
+ * counts something else entirely, so two counts only match under the
+ * same generation.
+ */
+uint64_t clip_generation(const struct clip_source *src);
@@ -0,0 +1,443 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "msg.h"
+#include "clip.h"
+#include "copy.h"
+#include "hash.h"
+#include "history.h"
+#include "normalize.h"
+#include "timing.h"
+#include "user_path.h"
+
+/*
+ * --copy: read everything from fd and hand it to the clipboard sink.
+ *
+ * Input collects in memory until it reaches the spill threshold
+ * (REATTACH_COPY_SPILL bytes, default 8 MiB); after that the memory is
+ * written to an unlinked temporary file in the per-user directory and
+ * later reads go straight to that file through one fixed-size buffer.
+ * The sink is then given the file (or, if it can only take memory, an
+ * mmap of it), so resident memory stays near the threshold however
+ * large the copy is.
+ *
+ * With REATTACH_COPY_DEDUP set, the input is hashed as it arrives and
+ * compared with what the last copy recorded in "copy-hash" in the
+ * per-user directory: when the hash, the length and the clipboard's
+ * change count all still match, the clipboard already holds this text
+ * and the sink is not written at all. (The change count is what tells
+ * us nobody else has copied in between; where the clipboard has none,
+ * every copy is written.)
+ *
+ * With REATTACH_COPY_DEBOUNCE=<ms>, copies that arrive together are
+ * coalesced: each one, once it has all of its input, takes the next
+ * ticket from "copy-slot" in the per-user directory and waits that
+ * long. Only a copy that still holds the newest ticket afterwards (and
+ * under the slot's lock, so writes cannot overtake each other) writes
+ * the sink; older ones exit successfully without writing. A burst of
+ * copies thus costs one write, and the newest text wins.
+ *
+ * With REATTACH_COPY_NORMALIZE set (to some of utf8, utf8-strict, crlf
+ * and trim, comma separated; empty for utf8,crlf,trim), the input goes
+ * through normalize.c as it is read, and everything after (the spill,
+ * the dedup hash, the sink) sees only the normalized text.
+ *
+ * With REATTACH_COPY_HISTORY set, each copy that is written is also
+ * added to the copy history (see history.c), with the same hash.
+ *
+ * With REATTACH_COPY_STATS set, bytes, throughput and peak RSS are
+ * reported on stderr.
+ */
+
+#define READ_SIZE (1024 * 1024)
+#define DEFAULT_SPILL (8 * 1024 * 1024)
+
+struct spill_buf {
+    char *mem;
+    size_t len, alloc;
+    size_t threshold;
+    int fd;             /* -1 until spilled */
+    struct hash_state *hash;    /* NULL unless deduplicating */
+    struct normalize *norm;     /* NULL unless normalizing */
+};
+
+#define DEDUP_MAGIC 0x72746368 /* "rtch" */
+
+/* the last copy written, and what became of copies since */
+struct dedup_state {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t hash;
+    uint64_t len;
+    int64_t count;
+    uint64_t written, skipped;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int spill(struct spill_buf *b)
+{
+    char path[PATH_MAX];
+
+    if (user_path(path, sizeof(path), "copy.XXXXXX"))
+        return -1;
+    if ((b->fd = mkstemp(path)) < 0) {
+        warn_errno("unable to create %s", path);
+        return -1;
+    }
+    unlink(path);
+    if (write_all(b->fd, b->mem, b->len)) {
+        warn_errno("unable to write copy spill file");
+        return -1;
+    }
+
+    /* from here on mem is only a staging area for each read */
+    free(b->mem);
+    b->alloc = READ_SIZE;
+    if (!(b->mem = malloc(b->alloc))) {
+        warn("out of memory");
+        return -1;
+    }
+    return 0;
+}
+
+/* free space for the next read, spilling if the buffer would pass the threshold */
+static char *read_space(struct spill_buf *b, size_t *space)
+{
+    if (b->fd >= 0) {
+        *space = b->alloc;
+        return b->mem;
+    }
+    if (b->alloc - b->len < READ_SIZE) {
+        size_t want = b->alloc ? b->alloc * 2 : 2 * READ_SIZE;
+        if (want > b->threshold) {
+            if (spill(b))
+                return NULL;
+            return read_space(b, space);
+        }
+        char *m = realloc(b->mem, want);
+        if (!m) {
+            warn("out of memory");
+            return NULL;
+        }
+        b->mem = m;
+        b->alloc = want;
+    }
+    *space = b->alloc - b->len;
+    return b->mem + b->len;
+}
+
+static int got(struct spill_buf *b, size_t n)
+{
+    if (b->fd < 0) {
+        b->len += n;
+        return 0;
+    }
+    if (write_all(b->fd, b->mem, n)) {
+        warn_errno("unable to write copy spill file");
+        return -1;
+    }
+    b->len += n;
+    return 0;
+}
+
+/* take normalized text: the normalizer's emit */
+static int store(void *ctx, const char *data, size_t len)
+{
+    struct spill_buf *b = ctx;
+
+    if (b->hash)
+        hash_update(b->hash, data, len);
+    while (len) {
+        size_t space;
+        char *p = read_space(b, &space);
+        if (!p)
+            return -1;
+        if (space > len)
+            space = len;
+        memcpy(p, data, space);
+        if (got(b, space))
+            return -1;
+        data += space;
+        len -= space;
+    }
+    return 0;
+}
+
+static int read_normalized(struct spill_buf *b, int fd)
+{
+    char *raw = malloc(READ_SIZE);
+    int r = -1;
+
+    if (!raw) {
+        warn("out of memory");
+        return -1;
+    }
+    for (;;) {
+        ssize_t n = read(fd, raw, READ_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            warn_errno("copy: read failed");
+            break;
+        }
+        if (!n) {
+            r = normalize_final(b->norm);
+            break;
+        }
+        if (normalize_update(b->norm, raw, n))
+            break;
+    }
+    free(raw);
+    return r;
+}
+
+static int read_in(struct spill_buf *b, int fd)
+{
+    if (b->norm)
+        return read_normalized(b, fd);
+    for (;;) {
+        size_t space;
+        char *p = read_space(b, &space);
+        if (!p)
+            return -1;
+        ssize_t r = read(fd, p, space);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            warn_errno("copy: read failed");
+            return -1;
+        }
+        if (!r)
+            return 0;
+        if (b->hash)
+            hash_update(b->hash, p, r);
+        if (got(b, r))
+            return -1;
+    }
+}
+
+static void dedup_load(struct dedup_state *d)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if (!user_path(path, sizeof(path), "copy-hash") &&
+            (fd = open(path, O_RDONLY)) >= 0) {
+        ssize_t n = read(fd, d, sizeof(*d));
+        close(fd);
+        if (n == sizeof(*d) && d->magic == DEDUP_MAGIC)
+            return;
+    }
+    memset(d, 0, sizeof(*d));
+    d->magic = DEDUP_MAGIC;
+    d->count = -1;
+}
+
+static void dedup_save(const struct dedup_state *d)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    int fd;
+
+    if (user_path(path, sizeof(path), "copy-hash") ||
+            user_path(tmp, sizeof(tmp), "copy-hash.XXXXXX"))
+        return;
+    if ((fd = mkstemp(tmp)) < 0)
+        return;
+    if (write_all(fd, d, sizeof(*d)) || close(fd) || rename(tmp, path))
+        unlink(tmp);
+}
+
+static long change_count(void)
+{
+    const struct clip_source *src = clip_source();
+    return src && src->change_count ? src->change_count() : -1;
+}
+
+/*
+ * Take a ticket and sit out the debounce window. Returns the slot's fd,
+ * locked until it is closed, if this copy is still the newest; -2 if a
+ * newer one came along (it will do the writing); -1 if the slot is not
+ * usable (so just write).
+ */
+static int coalesce(unsigned long ms)
+{
+    char path[PATH_MAX];
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    struct stat st;
+    uint64_t *slot, ticket;
+    int fd;
+
+    if (user_path(path, sizeof(path), "copy-slot") ||
+            (fd = open(path, O_RDWR|O_CREAT, 0600)) < 0)
+        return -1;
+    if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(*slot) &&
+                ftruncate(fd, sizeof(*slot)))) {
+        close(fd);
+        return -1;
+    }
+    slot = mmap(NULL, sizeof(*slot), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (slot == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ticket = __atomic_add_fetch(slot, 1, __ATOMIC_ACQ_REL);
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+    while (flock(fd, LOCK_EX) && errno == EINTR)
+        ;
+    if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != ticket) {
+        debug("copy: superseded by a newer copy; not written");
+        munmap(slot, sizeof(*slot));
+        close(fd);
+        return -2;
+    }
+    munmap(slot, sizeof(*slot));
+    return fd;
+}
+
+static void stats(size_t len, uint64_t ns)
+{
+    struct rusage ru;
+    long maxrss = 0;
+
+    if (!getrusage(RUSAGE_SELF, &ru))
+        maxrss = ru.ru_maxrss;
+#ifdef __APPLE__
+    maxrss /= 1024; /* bytes there, KiB elsewhere */
+#endif
+    msg("copy: %lu bytes in %.3fms (%.1f MB/s), peak RSS %ld KiB",
+            (unsigned long)len, ns / 1e6,
+            ns ? len / (ns / 1e9) / 1e6 : 0.0, maxrss);
+}
+
+int copy_main(int fd)
+{
+    const char *s = getenv("REATTACH_COPY_SPILL");
+    const char *debounce = getenv("REATTACH_COPY_DEBOUNCE");
+    const char *normalize = getenv("REATTACH_COPY_NORMALIZE");
+    struct spill_buf b = { NULL, 0, 0, DEFAULT_SPILL, -1, NULL, NULL };
+    struct normalize norm;
+    unsigned int flags;
+    const struct clip_sink *sink;
+    struct hash_state hash;
+    struct dedup_state d;
+    uint64_t t0 = now_ns(), h = 0;
+    int r = 1, slot = -1, dedup = getenv("REATTACH_COPY_DEDUP") != NULL;
+
+    if (s && *s)
+        b.threshold = strtoul(s, NULL, 0);
+    if (dedup || history_enabled()) {
+        hash_init(&hash);
+        b.hash = &hash;
+    }
+    if (normalize) {
+        if (normalize_flags(normalize, &flags)) {
+            warn("copy: bad REATTACH_COPY_NORMALIZE: %s", normalize);
+            return 1;
+        }
+        if (normalize_init(&norm, flags, store, &b))
+            return 1;
+        b.norm = &norm;
+    }
+    if (!(sink = clip_sink()))
+        goto done;
+    if (read_in(&b, fd))
+        goto done;
+    if (b.norm)
+        debug("copy: normalized: %llu invalid UTF-8 sequences replaced,"
+                " %llu CRLFs, %llu trailing blanks", (unsigned long long)norm.replaced,
+                (unsigned long long)norm.crlf, (unsigned long long)norm.trimmed);
+
+    if (debounce && *debounce &&
+            (slot = coalesce(strtoul(debounce, NULL, 10))) == -2) {
+        r = 0;
+        goto done;
+    }
+    if (b.hash)
+        h = hash_final(&hash);
+    if (dedup) {
+        dedup_load(&d);
+        if (d.hash == h && d.len == b.len && d.count >= 0 &&
+                d.count == change_count()) {
+            d.skipped++;
+            dedup_save(&d);
+            debug("copy: same %lu bytes as the last copy; not written"
+                    " (%llu skipped, %llu written)", (unsigned long)b.len,
+                    (unsigned long long)d.skipped, (unsigned long long)d.written);
+            r = 0;
+            goto report;
+        }
+    }
+
+    const char *data = b.mem;
+    void *map = NULL;
+    if (b.fd >= 0 && sink->put_fd) {
+        r = sink->put_fd(b.fd, b.len) ? 1 : 0;
+        goto written;
+    }
+    if (b.fd >= 0 && b.len) {
+        map = mmap(NULL, b.len, PROT_READ, MAP_SHARED, b.fd, 0);
+        if (map == MAP_FAILED) {
+            warn_errno("unable to map copy spill file");
+            goto done;
+        }
+        madvise(map, b.len, MADV_SEQUENTIAL);
+        data = map;
+    }
+
+    r = sink->put(data ? data : "", b.len) ? 1 : 0;
+    if (map)
+        munmap(map, b.len);
+written:
+    if (history_enabled() && !r) {
+        if (b.fd >= 0)
+            history_add_fd(b.fd, b.len, h);
+        else
+            history_add(b.mem ? b.mem : "", b.len, h);
+    }
+    if (dedup && !r) {
+        d.hash = h;
+        d.len = b.len;
+        d.count = change_count();
+        d.written++;
+        dedup_save(&d);
+    }
+report:
+    if (getenv("REATTACH_COPY_STATS"))
+        stats(b.len, now_ns() - t0);
+
+done:
+    if (slot >= 0)
+        close(slot);
+    if (b.fd >= 0)
+        close(b.fd);
+    if (b.norm)
+        normalize_free(b.norm);
+    free(b.mem);
+    return r;
+}
@@ -0,0 +1 @@
+int copy_main(int fd);
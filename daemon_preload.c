@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef __APPLE__
+#include <dlfcn.h>
+#endif
+
+/*
+ * A daemon(3) that keeps the per-user bootstrap namespace, to be
+ * preloaded into a server that daemonizes (tmux, screen):
+ *
+ *     DYLD_INSERT_LIBRARIES=/path/to/reattach_daemon.dylib tmux
+ *
+ * Darwin's daemon(3) moves the caller into the root namespace; this
+ * one does what it otherwise does (fork with the parent exiting,
+ * setsid, chdir to / and stdio to /dev/null unless asked not to) and
+ * then detaches from the console the way test.c's "daemon=ours detach"
+ * found to work (see NOTES), so the server and everything it starts
+ * keep pasteboard access without a wrapper per pane.
+ *
+ * Elsewhere (LD_PRELOAD) it is only the fork/setsid/dup2 part, which
+ * "make check-daemon" compares with the real daemon(3).
+ *
+ * With REATTACH_LOG_LEVEL=debug it says so on stderr when it is used.
+ */
+
+static int reattach_daemon(int nochdir, int noclose)
+{
+    const char *level = getenv("REATTACH_LOG_LEVEL");
+    pid_t p;
+    int fd;
+
+    if (level && !strcmp(level, "debug")) {
+        static const char note[] = "debug: daemon() interposed\n";
+        fd = write(2, note, sizeof(note) - 1);
+    }
+
+    if ((p = fork()) < 0)
+        return -1;
+    if (p > 0)
+        _exit(0);
+    if (setsid() < 0)
+        return -1;
+    if (!nochdir && chdir("/") < 0)
+        return -1;
+    if (!noclose && (fd = open("/dev/null", O_RDWR)) >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2)
+            close(fd);
+    }
+
+#ifdef __APPLE__
+    {
+        typedef void *(*detach_from_console_f)(unsigned int flags);
+        void *f = dlsym(RTLD_DEFAULT, "_vprocmgr_detach_from_console");
+        if (f)
+            ((detach_from_console_f)f)(0);
+    }
+#endif
+    return 0;
+}
+
+#ifdef __APPLE__
+/* dyld swaps our function in for every image's calls to daemon */
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+__attribute__((used)) static const struct {
+    const void *replacement, *replacee;
+} interpose[] __attribute__((section("__DATA,__interpose"))) = {
+    { (const void *)reattach_daemon, (const void *)daemon },
+};
+#else
+int daemon(int nochdir, int noclose)
+{
+    return reattach_daemon(nochdir, noclose);
+}
+#endif
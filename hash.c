@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "hash.h"
+
+/*
+ * A non-cryptographic hash built the way XXH3 is: eight 64-bit lanes,
+ * each taking one word of every 64-byte stripe mixed with a key word
+ * through a 32x32->64 multiply, with a scramble after every 1 KiB
+ * block. The lanes are independent, so the compiler can keep them in
+ * vector registers; hashing runs near memory speed.
+ *
+ * It only has to agree with itself (copy.c compares it against what
+ * an earlier copy recorded), so the key is generated here rather than
+ * copied from XXH3, and the results differ from XXH3's.
+ */
+
+#define STRIPE 64
+#define STRIPES (HASH_BLOCK / STRIPE)
+#define KEY_WORDS (8 + STRIPES)
+
+#define PRIME32 0x9e3779b1U
+#define PRIME64 0x9e3779b97f4a7c15ULL
+
+static uint64_t key[KEY_WORDS];
+
+static uint64_t splitmix(uint64_t *s)
+{
+    uint64_t z = (*s += PRIME64);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void stripe(uint64_t acc[8], const unsigned char *p, const uint64_t *k)
+{
+    uint64_t v[8];
+    int i;
+
+    memcpy(v, p, sizeof(v));
+    for (i = 0; i < 8; i++) {
+        uint64_t m = v[i] ^ k[i];
+        acc[i] += (m & 0xffffffffULL) * (m >> 32) + v[i ^ 1];
+    }
+}
+
+static void scramble(uint64_t acc[8])
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        acc[i] = a * PRIME32;
+    }
+}
+
+static void block(uint64_t acc[8], const unsigned char *p)
+{
+    int s;
+    for (s = 0; s < STRIPES; s++)
+        stripe(acc, p + s * STRIPE, key + s);
+    scramble(acc);
+}
+
+void hash_init(struct hash_state *h)
+{
+    int i;
+
+    if (!key[0]) {
+        uint64_t s = 0;
+        for (i = 0; i < KEY_WORDS; i++)
+            key[i] = splitmix(&s);
+    }
+    for (i = 0; i < 8; i++)
+        h->acc[i] = key[i] ^ (PRIME64 * (i + 1));
+    h->total = 0;
+    h->buffered = 0;
+}
+
+void hash_update(struct hash_state *h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    h->total += len;
+    if (h->buffered) {
+        size_t n = HASH_BLOCK - h->buffered;
+        if (n > len)
+            n = len;
+        memcpy(h->buf + h->buffered, p, n);
+        h->buffered += n;
+        p += n;
+        len -= n;
+        if (h->buffered < HASH_BLOCK)
+            return;
+        block(h->acc, h->buf);
+        h->buffered = 0;
+    }
+    for (; len >= HASH_BLOCK; p += HASH_BLOCK, len -= HASH_BLOCK)
+        block(h->acc, p);
+    memcpy(h->buf, p, len);
+    h->buffered = len;
+}
+
+uint64_t hash_final(struct hash_state *h)
+{
+    unsigned char last[STRIPE];
+    uint64_t acc[8], r;
+    size_t s, n = h->buffered;
+    int i;
+
+    memcpy(acc, h->acc, sizeof(acc));
+    for (s = 0; (s + 1) * STRIPE <= n; s++)
+        stripe(acc, h->buf + s * STRIPE, key + s);
+    memset(last, 0, sizeof(last));
+    memcpy(last, h->buf + s * STRIPE, n - s * STRIPE);
+    stripe(acc, last, key + STRIPES - 1);
+
+    r = h->total * PRIME64;
+    for (i = 0; i < 8; i += 2) {
+        uint64_t a = acc[i] ^ key[i + 8], b = acc[i + 1] ^ key[i + 9];
+        r += (a & 0xffffffffULL) * (b >> 32) + (a >> 32) * (b & 0xffffffffULL) + (a ^ b);
+    }
+    r ^= r >> 37;
+    r *= 0x165667919e3779f9ULL;
+    return r ^ (r >> 32);
+}
@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_BLOCK 1024
+
+/* a streaming 64-bit hash; feed it with hash_update, in any pieces */
+struct hash_state {
+    uint64_t acc[8];
+    uint64_t total;
+    size_t buffered;
+    unsigned char buf[HASH_BLOCK];
+};
+
+void hash_init(struct hash_state *h);
+void hash_update(struct hash_state *h, const void *data, size_t len);
+uint64_t hash_final(struct hash_state *h);
@@ -0,0 +1,56 @@
+#include "hist.h"
+
+static unsigned int bucket_of(uint64_t v)
+{
+    unsigned int e;
+
+    if (v < (1u << HIST_SUB_BITS))
+        return v;
+    e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+        ((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/* the largest value that lands in bucket b */
+static uint64_t bucket_top(unsigned int b)
+{
+    unsigned int e, sub;
+
+    if (b < (1u << HIST_SUB_BITS))
+        return b;
+    e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    sub = b & ((1u << HIST_SUB_BITS) - 1);
+    return ((((uint64_t)1 << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_record(struct hist *h, uint64_t v)
+{
+    if (!h->count || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+    h->bucket[bucket_of(v)]++;
+}
+
+/* pct in [0,100]; the answer is capped at the largest value recorded */
+uint64_t hist_percentile(const struct hist *h, double pct)
+{
+    uint64_t want, seen = 0;
+    unsigned int b;
+
+    if (!h->count)
+        return 0;
+    want = (uint64_t)(h->count * pct / 100.0 + 0.5);
+    if (want < 1)
+        want = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= want) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,16 @@
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram (HDR style): 16 linear sub-buckets per
+ * power of two, so any recorded value is known to within 1/16th.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+    uint64_t count, min, max, sum;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+void hist_record(struct hist *h, uint64_t v);
+uint64_t hist_percentile(const struct hist *h, double pct);
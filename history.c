@@ -0,0 +1,433 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "msg.h"
+#include "history.h"
+#include "user_path.h"
+
+/*
+ * With REATTACH_COPY_HISTORY set, every --copy that reaches the
+ * clipboard is also appended to "copy-history" in the per-user
+ * directory, so that earlier copies can be listed and fetched again
+ * ("--history list", "--history get N") from any pane or session.
+ *
+ * The file is mapped whole: a header, a fixed index of slots (one per
+ * entry kept: where its bytes are, how many, their hash and when) and
+ * a ring of the bytes themselves. Copy number s (counting from 1) is
+ * in slot s % slots, so entry k back from the newest is found without
+ * reading anything else. Positions in the ring only ever grow; a
+ * copy's bytes are still there while its position is no more than the
+ * ring's size behind the header's head. New copies overwrite the
+ * oldest bytes (and slots) in place.
+ *
+ * Writers take an flock on the file; readers take nothing. A writer
+ * first clears the slot's sequence number, then moves the head past
+ * the bytes it is about to write (which retires any older copy they
+ * belong to), then writes the bytes and the slot, and only then sets
+ * the slot's sequence number and the header's count. A reader checks
+ * the slot's number before and after copying out of it, and the head
+ * after copying the bytes, and tries again if a writer got in the way.
+ * A writer that dies part way leaves an entry that is never visible.
+ *
+ * The sizes are fixed when the file is created:
+ * REATTACH_COPY_HISTORY_ENTRIES entries (default 1000, at most 1M)
+ * and REATTACH_COPY_HISTORY_SIZE bytes of ring (default 32 MiB, at
+ * most 1 GiB). A copy larger than the ring is not kept. Remove the
+ * file to change them.
+ */
+
+#define HISTORY_MAGIC 0x72746869 /* "rthi" */
+#define DEFAULT_ENTRIES 1000
+#define MAX_ENTRIES (1024 * 1024)
+#define DEFAULT_SIZE (32 * 1024 * 1024)
+#define MAX_SIZE (1024 * 1024 * 1024)
+#define RETRIES 8
+#define PREVIEW 48
+
+struct history_head {
+    uint32_t magic;
+    uint32_t slot_size;
+    uint64_t slots;
+    uint64_t data_size;
+    uint64_t seq;       /* copies added so far */
+    uint64_t head;      /* bytes written to the ring so far */
+};
+
+struct history_slot {
+    uint64_t seq;       /* 0 while being written */
+    uint64_t offset;    /* ring position of the first byte */
+    uint64_t len;
+    uint64_t hash;
+    int64_t time_us;
+};
+
+struct history_map {
+    struct history_head *h;
+    struct history_slot *slots;
+    unsigned char *data;
+    size_t size;
+    int fd;
+};
+
+static struct history_map writer = { NULL, NULL, NULL, 0, -1 };
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* name's value (def if unset or empty), or 0 (with a warning) if it is not 1..max */
+static uint64_t env_u64(const char *name, uint64_t def, uint64_t max)
+{
+    const char *v = getenv(name);
+    unsigned long long n;
+    char *rest;
+
+    if (!v || !*v)
+        return def;
+    errno = 0;
+    n = strtoull(v, &rest, 0);
+    if (errno || *rest || !n || n > max || *v == '-') {
+        warn("bad %s: %s (a number from 1 to %llu)", name, v, (unsigned long long)max);
+        return 0;
+    }
+    return n;
+}
+
+int history_enabled(void)
+{
+    return getenv("REATTACH_COPY_HISTORY") != NULL;
+}
+
+static size_t map_size(uint64_t slots, uint64_t data_size)
+{
+    return sizeof(struct history_head) + slots * sizeof(struct history_slot) + data_size;
+}
+
+static int map(struct history_map *m, int fd, int prot)
+{
+    struct history_head h;
+    struct stat st;
+    void *p;
+
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != HISTORY_MAGIC ||
+            h.slot_size != sizeof(struct history_slot) || !h.slots || !h.data_size ||
+            h.slots > MAX_ENTRIES || h.data_size > MAX_SIZE)
+        return -1;
+    m->size = map_size(h.slots, h.data_size);
+    if (fstat(fd, &st) || (uint64_t)st.st_size < m->size)
+        return -1;
+    if ((p = mmap(NULL, m->size, prot, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        return -1;
+    m->h = p;
+    m->slots = (struct history_slot *)(m->h + 1);
+    m->data = (unsigned char *)(m->slots + h.slots);
+    m->fd = fd;
+    return 0;
+}
+
+/* a new (empty) or foreign file: size it, and claim it with the magic last */
+static int create(int fd)
+{
+    struct history_head h = { 0, sizeof(struct history_slot), 0, 0, 0, 0 };
+
+    h.slots = env_u64("REATTACH_COPY_HISTORY_ENTRIES", DEFAULT_ENTRIES, MAX_ENTRIES);
+    h.data_size = env_u64("REATTACH_COPY_HISTORY_SIZE", DEFAULT_SIZE, MAX_SIZE);
+    if (!h.slots || !h.data_size)
+        return -1;
+    if (ftruncate(fd, 0) || ftruncate(fd, map_size(h.slots, h.data_size)) ||
+            pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+        return -1;
+    h.magic = HISTORY_MAGIC;
+    return pwrite(fd, &h.magic, sizeof(h.magic), 0) == sizeof(h.magic) ? 0 : -1;
+}
+
+/* map the history for appending, and lock it; creates it if need be */
+static struct history_map *lock_writer(void)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if (writer.fd < 0) {
+        if (user_path(path, sizeof(path), "copy-history") ||
+                (fd = open(path, O_RDWR|O_CREAT, 0600)) < 0)
+            return NULL;
+        while (flock(fd, LOCK_EX) && errno == EINTR)
+            ;
+        if (map(&writer, fd, PROT_READ|PROT_WRITE) &&
+                (create(fd) || map(&writer, fd, PROT_READ|PROT_WRITE))) {
+            warn("unable to set up the copy history in %s", path);
+            close(fd);
+            return NULL;
+        }
+        return &writer;
+    }
+    while (flock(writer.fd, LOCK_EX) && errno == EINTR)
+        ;
+    return &writer;
+}
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Start entry seq: clear its slot and move the head past its bytes.
+ * Returns the ring position to write them at.
+ */
+static uint64_t begin(struct history_map *m, struct history_slot **slot, size_t len)
+{
+    struct history_head *h = m->h;
+    uint64_t seq = h->seq + 1, start = h->head;
+
+    *slot = &m->slots[seq % h->slots];
+    __atomic_store_n(&(*slot)->seq, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->head, start + len, __ATOMIC_RELEASE);
+    /* readers must see the head move before any of the bytes change */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return start;
+}
+
+static void commit(struct history_map *m, struct history_slot *slot,
+        uint64_t start, size_t len, uint64_t hash)
+{
+    uint64_t seq = m->h->seq + 1;
+
+    slot->offset = start;
+    slot->len = len;
+    slot->hash = hash;
+    slot->time_us = now_us();
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&m->h->seq, seq, __ATOMIC_RELEASE);
+}
+
+static int too_big(struct history_map *m, size_t len)
+{
+    if (len <= m->h->data_size)
+        return 0;
+    debug("history: %lu bytes is more than it holds; not kept", (unsigned long)len);
+    flock(m->fd, LOCK_UN);
+    return 1;
+}
+
+int history_add(const void *data, size_t len, uint64_t hash)
+{
+    struct history_map *m = lock_writer();
+    struct history_slot *slot;
+    uint64_t start, pos;
+    size_t first;
+
+    if (!m)
+        return -1;
+    if (too_big(m, len))
+        return 0;
+    start = begin(m, &slot, len);
+    pos = start % m->h->data_size;
+    first = len < m->h->data_size - pos ? len : m->h->data_size - pos;
+    memcpy(m->data + pos, data, first);
+    memcpy(m->data, (const char *)data + first, len - first);
+    commit(m, slot, start, len, hash);
+    flock(m->fd, LOCK_UN);
+    return 0;
+}
+
+/* the same, for a copy that was spilled to fd: read straight into the ring */
+int history_add_fd(int fd, size_t len, uint64_t hash)
+{
+    struct history_map *m = lock_writer();
+    struct history_slot *slot;
+    uint64_t start;
+    size_t done = 0;
+
+    if (!m)
+        return -1;
+    if (too_big(m, len))
+        return 0;
+    start = begin(m, &slot, len);
+    while (done < len) {
+        uint64_t pos = (start + done) % m->h->data_size;
+        size_t want = len - done < m->h->data_size - pos ? len - done : m->h->data_size - pos;
+        ssize_t r = pread(fd, m->data + pos, want, done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            /* the slot stays cleared: the entry never appears */
+            warn_errno("history: unable to read the copy back");
+            flock(m->fd, LOCK_UN);
+            return -1;
+        }
+        done += r;
+    }
+    commit(m, slot, start, len, hash);
+    flock(m->fd, LOCK_UN);
+    return 0;
+}
+
+static struct history_map reader = { NULL, NULL, NULL, 0, -1 };
+
+static struct history_map *open_reader(void)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if (writer.h)
+        return &writer;
+    if (reader.h)
+        return &reader;
+    if (user_path(path, sizeof(path), "copy-history") ||
+            (fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (map(&reader, fd, PROT_READ)) {
+        close(fd);
+        return NULL;
+    }
+    return &reader;
+}
+
+/*
+ * Entry k back from the newest (0 is the newest): fill e, and buf with
+ * up to size of its bytes. Returns 0, or -1 if there is no such entry
+ * (never added, or already overwritten).
+ */
+int history_get(uint64_t k, struct history_entry *e, void *buf, size_t size)
+{
+    const struct history_map *m = open_reader();
+    int tries;
+
+    if (!m)
+        return -1;
+    for (tries = 0; tries < RETRIES; tries++) {
+        const struct history_head *h = m->h;
+        uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE), head, pos;
+        const struct history_slot *slot;
+        size_t n, first;
+
+        if (k >= seq || k >= h->slots)
+            return -1;
+        seq -= k;
+        slot = &m->slots[seq % h->slots];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        e->seq = seq;
+        e->len = slot->len;
+        e->hash = slot->hash;
+        e->time_us = slot->time_us;
+        pos = slot->offset % h->data_size;
+        n = e->len < size ? e->len : size;
+        first = n < h->data_size - pos ? n : h->data_size - pos;
+        if (n) {
+            memcpy(buf, m->data + pos, first);
+            memcpy((char *)buf + first, m->data, n - first);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (head > h->data_size && slot->offset < head - h->data_size)
+            return -1;      /* its bytes are gone */
+        return 0;
+    }
+    return -1;
+}
+
+static void list(void)
+{
+    struct history_entry e;
+    unsigned char preview[PREVIEW];
+    char when[32];
+    uint64_t k;
+    size_t i, n;
+
+    for (k = 0; !history_get(k, &e, preview, sizeof(preview)); k++) {
+        time_t t = e.time_us / 1000000;
+        struct tm tm;
+
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+        n = e.len < sizeof(preview) ? e.len : sizeof(preview);
+        printf("%llu  %s  %llu bytes  %016llx  ", (unsigned long long)k, when,
+                (unsigned long long)e.len, (unsigned long long)e.hash);
+        for (i = 0; i < n && preview[i] != '\n'; i++)
+            putchar(preview[i] < 0x20 || preview[i] == 0x7f ? '.' : preview[i]);
+        /* "..." if there is more than this line (and its newline) */
+        printf("%s\n", i + (i < n && preview[i] == '\n') < e.len ? "..." : "");
+    }
+}
+
+static int get(uint64_t k)
+{
+    struct history_entry e;
+    char *buf = NULL;
+    int r = 1, tries;
+
+    /* once for the length, then for the bytes (again if it changed) */
+    for (tries = 0; tries < RETRIES; tries++) {
+        uint64_t seq;
+        if (history_get(k, &e, NULL, 0)) {
+            warn("history: no entry %llu", (unsigned long long)k);
+            break;
+        }
+        seq = e.seq;
+        free(buf);
+        if (!(buf = malloc(e.len ? e.len : 1))) {
+            warn("out of memory");
+            break;
+        }
+        if (history_get(k, &e, buf, e.len) || e.seq != seq)
+            continue;
+        if (write_all(1, buf, e.len))
+            warn_errno("history: write failed");
+        else
+            r = 0;
+        break;
+    }
+    free(buf);
+    return r;
+}
+
+/* --history list | --history get <N> */
+int history_main(const char *cmd, const char *arg)
+{
+    char *rest;
+    unsigned long long k;
+
+    if (!open_reader()) {
+        warn("no copy history (is REATTACH_COPY_HISTORY set for --copy?)");
+        return 1;
+    }
+    if (!strcmp(cmd, "list") && !arg) {
+        list();
+        return fflush(stdout) ? 1 : 0;
+    }
+    if (!strcmp(cmd, "get") && arg && *arg) {
+        k = strtoull(arg, &rest, 10);
+        if (!*rest)
+            return get(k);
+    }
+    warn("usage: --history list | --history get <N>");
+    return 2;
+}
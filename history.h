@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* one copy in the history; see history.c */
+struct history_entry {
+    uint64_t seq;       /* 1 for the first copy ever kept, and so on */
+    uint64_t len;
+    uint64_t hash;
+    int64_t time_us;    /* when it was copied, since the epoch */
+};
+
+int history_enabled(void);
+int history_add(const void *data, size_t len, uint64_t hash);
+int history_add_fd(int fd, size_t len, uint64_t hash);
+int history_get(uint64_t k, struct history_entry *e, void *buf, size_t size);
+int history_main(const char *cmd, const char *arg);
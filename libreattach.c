@@ -0,0 +1,306 @@
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <sys/time.h>
+
+#include "msg.h"
+#include "backend.h"
+#include "path_cache.h"
+#include "reattach.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * The library side of the wrapper; see reattach.h.
+ *
+ * After a move, REATTACH_NAMESPACE=<uid>.<session id> is put in the
+ * environment of what we start. A process that inherits it with its
+ * own uid and session skips the move altogether: it is a descendant
+ * (a shell run by the wrapper, and whatever that shell runs through
+ * the wrapper again) of one that already moved. daemon(3), which is
+ * what loses the namespace in the first place, also starts a new
+ * session, so a marker that made it through one is not honoured.
+ * REATTACH_FORCE_MOVE always moves.
+ *
+ * With REATTACH_TIMEOUT_MS set, the move runs on its own thread and
+ * we wait at most that long for it (launchd can stall right after
+ * login or under load). Past the deadline the move is abandoned: we
+ * answer -1 (errno ETIMEDOUT) and the caller carries on as after any
+ * other failure. The thread is left blocked where it is; the wrapper
+ * is about to exec, which ends it, and a host that embeds us may yet
+ * find itself moved when it finishes. Whatever it finishes with is not
+ * recorded (see backend.c), and its trace events are safe to make
+ * alongside ours.
+ */
+
+#define MARKER "REATTACH_NAMESPACE"
+
+extern char **environ;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int init_result, init_errno;
+static char marker[sizeof(MARKER) + 48] = MARKER "=";
+
+static const char *marker_value(void)
+{
+    return marker + sizeof(MARKER);
+}
+
+static int already_reattached(void)
+{
+    const char *v = getenv(MARKER);
+    return v && !getenv("REATTACH_FORCE_MOVE") && !strcmp(v, marker_value());
+}
+
+static pthread_mutex_t move_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t move_done = PTHREAD_COND_INITIALIZER;
+static int move_finished, move_result;
+
+static void *move_thread(void *arg)
+{
+    int r = reattach_to_user_namespace(arg) ? -1 : 0;
+
+    pthread_mutex_lock(&move_lock);
+    move_result = r;
+    move_finished = 1;
+    pthread_cond_signal(&move_done);
+    pthread_mutex_unlock(&move_lock);
+    return NULL;
+}
+
+/* 0 for no deadline */
+static unsigned long timeout_ms(void)
+{
+    const char *v = getenv("REATTACH_TIMEOUT_MS");
+    char *rest;
+    unsigned long ms;
+
+    if (!v || !*v)
+        return 0;
+    ms = strtoul(v, &rest, 10);
+    if (*rest) {
+        warn("ignoring REATTACH_TIMEOUT_MS=%s (not a number)", v);
+        return 0;
+    }
+    return ms;
+}
+
+/* the move, bounded by REATTACH_TIMEOUT_MS if that is set */
+static int move(void)
+{
+    unsigned long ms = timeout_ms();
+    struct timespec deadline;
+    struct timeval now;
+    pthread_attr_t attr;
+    pthread_t t;
+    int r = 0;
+
+    if (!ms)
+        return reattach_to_user_namespace("reattach") ? -1 : 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    r = pthread_create(&t, &attr, move_thread, "reattach");
+    pthread_attr_destroy(&attr);
+    if (r) {
+        warn("unable to start the watchdog (%s); moving without a deadline",
+                strerror(r));
+        return reattach_to_user_namespace("reattach") ? -1 : 0;
+    }
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000L + (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    TRACE_BEGIN("watchdog", NULL);
+    pthread_mutex_lock(&move_lock);
+    while (!move_finished && r != ETIMEDOUT)
+        r = pthread_cond_timedwait(&move_done, &move_lock, &deadline);
+    if (move_finished)
+        r = move_result;
+    pthread_mutex_unlock(&move_lock);
+    TRACE_END("watchdog", NULL);
+
+    if (r == ETIMEDOUT) {
+        reattach_abandon_move();
+        debug("reattach: no answer after %lums; giving up on the move", ms);
+        TRACE_MARK("reattach timed out", NULL);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return r;
+}
+
+/* the move itself; other threads calling reattach_init wait for it */
+static void init(void)
+{
+    snprintf(marker + sizeof(MARKER), sizeof(marker) - sizeof(MARKER),
+            "%u.%ld", (unsigned)getuid(), (long)getsid(0));
+    if (already_reattached()) {
+        debug("already reattached (%s=%s); not moving", MARKER, marker_value());
+        TRACE_MARK("already reattached", NULL);
+        init_result = 0;
+    } else {
+        errno = 0;
+        init_result = move();
+        init_errno = errno == ETIMEDOUT ? ETIMEDOUT : 0;
+    }
+}
+
+int reattach_init(void)
+{
+    pthread_once(&init_once, init);
+    if (init_errno)
+        errno = init_errno;
+    return init_result;
+}
+
+size_t reattach_env_size(char * const from[])
+{
+    size_t n = 0;
+    while (from[n])
+        n++;
+    return n + 2;
+}
+
+char **reattach_env(char *env[], char * const from[])
+{
+    size_t i, n = 0;
+    int mark = !reattach_init();
+
+    for (i = 0; from[i]; i++)
+        if (!mark || strncmp(from[i], MARKER "=", sizeof(MARKER)))
+            env[n++] = from[i];
+    if (mark)
+        env[n++] = marker;
+    env[n] = NULL;
+    return env;
+}
+
+pid_t reattach_spawn(char * const argv[], char * const envp[], const int fds[3])
+{
+    char * const *from = envp ? envp : environ;
+    char *env[reattach_env_size(from)];
+    posix_spawn_file_actions_t fa;
+    pid_t pid;
+    int i, r;
+
+    reattach_env(env, from);
+    if ((r = posix_spawn_file_actions_init(&fa))) {
+        errno = r;
+        return -1;
+    }
+    for (i = 0; fds && i < 3 && !r; i++)
+        if (fds[i] >= 0 && fds[i] != i)
+            r = posix_spawn_file_actions_adddup2(&fa, fds[i], i);
+    if (!r)
+        r = posix_spawnp(&pid, argv[0], &fa, NULL, argv, env);
+    posix_spawn_file_actions_destroy(&fa);
+    if (r) {
+        errno = r;
+        return -1;
+    }
+    return pid;
+}
+
+/* run file as a shell script, as execvp does for ENOEXEC */
+static void exec_script(const char *path, char * const argv[], char * const env[])
+{
+    size_t argc = 0;
+
+    while (argv[argc])
+        argc++;
+    {
+        char *sh[argc + 2];
+        size_t i;
+
+        sh[0] = "sh";
+        sh[1] = (char *)path;
+        for (i = 1; i <= argc; i++)
+            sh[i + 1] = argv[i];
+        execve("/bin/sh", sh, env);
+    }
+}
+
+/* execvp with env, which not every libc has (execvpe) */
+static void exec_search(const char *file, char * const argv[], char * const env[])
+{
+    const char *path = getenv("PATH"), *dir, *end;
+    size_t flen = strlen(file);
+    char buf[PATH_MAX];
+    int eacces = 0;
+
+    if (strchr(file, '/')) {
+        execve(file, argv, env);
+        if (errno == ENOEXEC)
+            exec_script(file, argv, env);
+        return;
+    }
+    if (!path)
+        path = "/usr/bin:/bin";
+    for (dir = path; ; dir = end + 1) {
+        size_t dlen;
+
+        end = strchr(dir, ':');
+        if (!end)
+            end = dir + strlen(dir);
+        dlen = end - dir;
+        if (!dlen) {
+            buf[0] = '.';
+            dlen = 1;
+        } else if (dlen + 1 + flen < sizeof(buf))
+            memcpy(buf, dir, dlen);
+        if (dlen + 1 + flen < sizeof(buf)) {
+            buf[dlen] = '/';
+            memcpy(buf + dlen + 1, file, flen + 1);
+            execve(buf, argv, env);
+            if (errno == ENOEXEC)
+                exec_script(buf, argv, env);
+            if (errno == EACCES)
+                eacces = 1;
+            else if (errno != ENOENT && errno != ENOTDIR)
+                return;
+        }
+        if (!*end)
+            break;
+    }
+    errno = eacces ? EACCES : ENOENT;
+}
+
+/*
+ * Nothing here allocates or touches anything shared: the marked
+ * environment and the resolved path live on our stack until the exec
+ * replaces it.
+ */
+int reattach_execvp(const char *file, char * const argv[])
+{
+    char *env[reattach_env_size(environ)], resolved[PATH_MAX];
+    const char *cached;
+
+    reattach_env(env, environ);
+    cached = path_cache_lookup(file, resolved, sizeof(resolved));
+
+    TRACE_MARK("execvp", file);
+    trace_flush();
+    msg_flush();
+    stats_exec();
+    if (cached)
+        execve(cached, argv, env);
+    exec_search(file, argv, env);
+    stats_exec_failed();
+    return -1;
+}
+
+int reattach_exec(char * const argv[])
+{
+    return reattach_execvp(argv[0], argv);
+}
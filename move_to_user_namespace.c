@@ -1,62 +1,86 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <dlfcn.h>
 #include <mach/mach.h>
 
 #include "msg.h"
+#include "backend.h"
+#include "trace.h"
 
-#define FIND_SYMBOL(NAME, RET, SIG) \
-    static const char fn_ ## NAME [] = # NAME; \
-    typedef RET (*ft_ ## NAME) SIG; \
-    ft_ ## NAME f_ ## NAME; \
-    if (!(f_ ## NAME = (ft_ ## NAME)dlsym(RTLD_NEXT, fn_ ## NAME))) { \
-        warn("unable to find %s: %s", fn_ ## NAME, dlerror()); \
-        return -1; \
-    }
+typedef void *(*ft_move_subset_100500)(uid_t, const char *);
+typedef void *(*ft_move_subset_100600)(uid_t, const char *, uint64_t);
+typedef kern_return_t (*ft_bootstrap_get_root)(mach_port_t, mach_port_t *);
+typedef kern_return_t (*ft_bootstrap_look_up_per_user)(mach_port_t, const char *, uid_t, mach_port_t *);
+
+static const char * const syms_vprocmgr[] = {
+    "_vprocmgr_move_subset_to_user", NULL
+};
+static const char * const syms_bootstrap[] = {
+    "bootstrap_get_root", "bootstrap_look_up_per_user", NULL
+};
+
+static void *resolved_100500[1], *resolved_100600[1], *resolved_101000[2];
 
-static int move_to_user_namespace__100500(void)
+static int move_to_user_namespace__100500(const struct reattach_backend *b)
 {
-    FIND_SYMBOL(_vprocmgr_move_subset_to_user, void *, (uid_t, const char *))
+    ft_move_subset_100500 f = (ft_move_subset_100500)b->resolved[0];
 
-    if (f__vprocmgr_move_subset_to_user(getuid(), "Background") != NULL) {
-        warn("%s failed", fn__vprocmgr_move_subset_to_user);
+    TRACE_BEGIN(b->symbols[0], NULL);
+    void *r = f(getuid(), "Background");
+    TRACE_END(b->symbols[0], NULL);
+    if (r != NULL) {
+        warn("%s failed", b->symbols[0]);
         return -1;
     }
 
     return 0;
 }
 
-static int move_to_user_namespace__100600(void)
+static int move_to_user_namespace__100600(const struct reattach_backend *b)
 {
-    FIND_SYMBOL(_vprocmgr_move_subset_to_user, void *, (uid_t, const char *, uint64_t))
+    ft_move_subset_100600 f = (ft_move_subset_100600)b->resolved[0];
 
-    if (f__vprocmgr_move_subset_to_user(getuid(), "Background", 0) != NULL) {
-        warn("%s failed", fn__vprocmgr_move_subset_to_user);
+    TRACE_BEGIN(b->symbols[0], NULL);
+    void *r = f(getuid(), "Background", 0);
+    TRACE_END(b->symbols[0], NULL);
+    if (r != NULL) {
+        warn("%s failed", b->symbols[0]);
         return -1;
     }
 
     return 0;
 }
 
-static int move_to_user_namespace__101000(void)
+static int move_to_user_namespace__101000(const struct reattach_backend *b)
 {
     mach_port_t puc = MACH_PORT_NULL;
     mach_port_t rootbs = MACH_PORT_NULL;
 
-    FIND_SYMBOL(bootstrap_get_root, kern_return_t, (mach_port_t, mach_port_t *))
-    FIND_SYMBOL(bootstrap_look_up_per_user, kern_return_t, (mach_port_t, const char *, uid_t, mach_port_t *))
+    ft_bootstrap_get_root f_get_root = (ft_bootstrap_get_root)b->resolved[0];
+    ft_bootstrap_look_up_per_user f_look_up_per_user =
+        (ft_bootstrap_look_up_per_user)b->resolved[1];
 
-    if (f_bootstrap_get_root(bootstrap_port, &rootbs) != KERN_SUCCESS) {
-        warn("%s failed", fn_bootstrap_get_root);
+    kern_return_t kr;
+
+    TRACE_BEGIN(b->symbols[0], NULL);
+    kr = f_get_root(bootstrap_port, &rootbs);
+    TRACE_END(b->symbols[0], NULL);
+    if (kr != KERN_SUCCESS) {
+        warn("%s failed", b->symbols[0]);
         return -1;
     }
-    if (f_bootstrap_look_up_per_user(rootbs, NULL, getuid(), &puc) != KERN_SUCCESS) {
-        warn("%s failed", fn_bootstrap_look_up_per_user);
+    TRACE_BEGIN(b->symbols[1], NULL);
+    kr = f_look_up_per_user(rootbs, NULL, getuid(), &puc);
+    TRACE_END(b->symbols[1], NULL);
+    if (kr != KERN_SUCCESS) {
+        warn("%s failed", b->symbols[1]);
         return -1;
     }
 
-    if (task_set_bootstrap_port(mach_task_self(), puc) != KERN_SUCCESS) {
+    TRACE_BEGIN("task_set_bootstrap_port", NULL);
+    kr = task_set_bootstrap_port(mach_task_self(), puc);
+    TRACE_END("task_set_bootstrap_port", NULL);
+    if (kr != KERN_SUCCESS) {
         warn("task_set_bootstrap_port failed");
         return -1;
     }
@@ -70,20 +94,17 @@ static int move_to_user_namespace__101000(void)
     return 0;
 }
 
-int move_to_user_namespace(unsigned int os)
-{
-    switch (os) {
-    case 100500:
-        return move_to_user_namespace__100500();
-
-    case 100600:
-        return move_to_user_namespace__100600();
-
-    case 101000:
-        return move_to_user_namespace__101000();
-
-    default:
-        warn("move_to_user_namespace: unhandled os value: %u", os);
-        return -1;
-    }
-}
+/*
+ * 10.6 through 10.9 still have _vprocmgr_move_subset_to_user; later
+ * releases only have the bootstrap calls, so each falls back to the
+ * other (the probe skips whichever one is missing).
+ */
+const struct reattach_backend reattach_backends[] = {
+    { "10.10", 101000, syms_bootstrap, resolved_101000,
+        move_to_user_namespace__101000, "10.6" },
+    { "10.6",  100600, syms_vprocmgr,  resolved_100600,
+        move_to_user_namespace__100600, "10.10" },
+    { "10.5",  100500, syms_vprocmgr,  resolved_100500,
+        move_to_user_namespace__100500, NULL },
+    { NULL, 0, NULL, NULL, NULL, NULL }
+};
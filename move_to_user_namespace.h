@@ -1 +1,6 @@
 int move_to_user_namespace(unsigned int os);
+
+#ifdef REATTACH_STUB
+#include <sys/utsname.h>
+int stub_uname(struct utsname *u);
+#endif
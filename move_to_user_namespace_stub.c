@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/utsname.h>
+
+#include "msg.h"
+#include "backend.h"
+#include "move_to_user_namespace.h"
+
+/*
+ * Stand-in for move_to_user_namespace.c on systems without launchd.
+ *
+ * It provides backends with the same names and fallbacks as the real
+ * ones, but they do no reattaching; they only cost what they are told
+ * to cost so that the rest of the wrapper can be run and timed:
+ *
+ *     REATTACH_STUB_DELAY_US   sleep this long in each "move"
+ *     REATTACH_STUB_FAIL       comma separated backend names whose
+ *                              "move" fails, or "all"
+ *     REATTACH_STUB_RELEASE    Darwin release reported by stub_uname
+ *                              (default 14.0.0, i.e. 10.10)
+ */
+
+static unsigned long env_ulong(const char *name)
+{
+    const char *v = getenv(name);
+    return v && *v ? strtoul(v, NULL, 0) : 0;
+}
+
+static int stub_fails(const char *name)
+{
+    const char *v = getenv("REATTACH_STUB_FAIL");
+    size_t len = strlen(name);
+
+    if (!v)
+        return 0;
+    if (!strcmp(v, "all"))
+        return 1;
+    while (*v) {
+        if (!strncmp(v, name, len) && (v[len] == ',' || v[len] == '\0'))
+            return 1;
+        v = strchr(v, ',');
+        if (!v)
+            break;
+        v++;
+    }
+    return 0;
+}
+
+int stub_uname(struct utsname *u)
+{
+    if (uname(u))
+        return -1;
+    const char *release = getenv("REATTACH_STUB_RELEASE");
+    strcpy(u->sysname, "Darwin");
+    strncpy(u->release, release && *release ? release : "14.0.0",
+            sizeof(u->release) - 1);
+    u->release[sizeof(u->release) - 1] = '\0';
+    return 0;
+}
+
+static int stub_move(const struct reattach_backend *b)
+{
+    unsigned long delay = env_ulong("REATTACH_STUB_DELAY_US");
+    if (delay) {
+        struct timespec ts = { delay / 1000000, (delay % 1000000) * 1000 };
+        while (nanosleep(&ts, &ts))
+            ;
+    }
+
+    if (stub_fails(b->name)) {
+        warn("stub move to user namespace (%s) failed", b->name);
+        return -1;
+    }
+    return 0;
+}
+
+static const char * const no_syms[] = { NULL };
+
+const struct reattach_backend reattach_backends[] = {
+    { "10.10", 101000, no_syms, NULL, stub_move, "10.6" },
+    { "10.6",  100600, no_syms, NULL, stub_move, "10.10" },
+    { "10.5",  100500, no_syms, NULL, stub_move, NULL },
+    { NULL, 0, NULL, NULL, NULL, NULL }
+};
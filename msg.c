@@ -29,76 +29,260 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <string.h>    /* strlen, strcpy, strerror */
+#include <stdint.h>
+#include <string.h>    /* strlen, memcpy, strerror */
 #include <stdarg.h>    /* va_...   */
-#include <stdio.h>     /* vfprintf */
-#include <stdlib.h>    /* malloc, exit, free */
+#include <stdio.h>     /* vsnprintf, fileno */
+#include <stdlib.h>    /* malloc, exit, free, getenv, atexit */
+#include <unistd.h>    /* write    */
 #include <sys/errno.h> /* errno    */
+#include <sys/uio.h>   /* writev   */
 
 #include "msg.h"
+#include "timing.h"
 
+/*
+ * Messages are formatted straight into a slot of a preallocated ring
+ * (no malloc, no stdio) and written out with one writev.
+ *
+ * Slots are claimed with an atomic increment, so any number of threads
+ * may log at once; whoever flushes writes every slot that is complete.
+ * Normally each message is flushed as soon as it is made. With
+ * REATTACH_LOG_DEFER set they are held until msg_flush, die, exit or a
+ * full ring instead (anything that execs should call msg_flush first).
+ *
+ * REATTACH_LOG_LEVEL (fatal, warning, info or debug; default info)
+ * drops less important messages before they are formatted, and
+ * REATTACH_LOG_TIME prefixes each one with a monotonic timestamp.
+ */
+
+#define RING_SLOTS 64           /* a power of two */
+#define SLOT_SIZE 512
+
+struct slot {
+    uint32_t ready;
+    uint32_t len;
+    char *big;                  /* text that did not fit in text[] */
+    char text[SLOT_SIZE];
+};
+
+static struct slot ring[RING_SLOTS];
+static uint64_t ring_head, ring_tail;
+static int ring_flushing;
+
+enum { LOG_UNSET = -1, LOG_FATAL, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+static int log_level = LOG_UNSET, log_defer, log_time;
+
+static void log_setup(void)
+{
+    static const char * const names[] = { "fatal", "warning", "info", "debug" };
+    const char *v = getenv("REATTACH_LOG_LEVEL");
+    int i, level = LOG_INFO;
+
+    for (i = 0; v && i < (int)(sizeof(names)/sizeof(*names)); i++)
+        if (!strcmp(v, names[i]))
+            level = i;
+    log_defer = !!getenv("REATTACH_LOG_DEFER");
+    log_time = !!getenv("REATTACH_LOG_TIME");
+    if (log_defer)
+        atexit(msg_flush);
+    __atomic_store_n(&log_level, level, __ATOMIC_RELEASE);
+}
+
+static int log_enabled(int level)
+{
+    int l = __atomic_load_n(&log_level, __ATOMIC_ACQUIRE);
+    if (l == LOG_UNSET) {
+        log_setup();
+        l = log_level;
+    }
+    return level <= l;
+}
+
+FILE *msgout = NULL;
+
+static int out_fd(void)
+{
+    if (!msgout)
+        return 2;
+    fflush(msgout);
+    return fileno(msgout);
+}
+
+static void write_iov(int fd, struct iovec *iov, int n)
+{
+    while (n) {
+        ssize_t r = n == 1 ? write(fd, iov->iov_base, iov->iov_len)
+                           : writev(fd, iov, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return;
+        while (n && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+}
+
+void msg_flush(void)
+{
+    struct iovec iov[RING_SLOTS];
+    int err = errno;
+
+    while (__atomic_test_and_set(&ring_flushing, __ATOMIC_ACQUIRE))
+        ;
+    uint64_t t = ring_tail, h = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    int i, n = 0;
+    for (; t + n < h; n++) {
+        struct slot *s = &ring[(t + n) % RING_SLOTS];
+        if (!__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE))
+            break;
+        iov[n].iov_base = s->big ? s->big : s->text;
+        iov[n].iov_len = s->len;
+    }
+    if (n)
+        write_iov(out_fd(), iov, n);
+    for (i = 0; i < n; i++) {
+        struct slot *s = &ring[(t + i) % RING_SLOTS];
+        free(s->big);
+        s->big = NULL;
+        __atomic_store_n(&s->ready, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&ring_tail, t + n, __ATOMIC_RELEASE);
+    __atomic_clear(&ring_flushing, __ATOMIC_RELEASE);
+    errno = err;
+}
+
+static struct slot *claim(void)
+{
+    uint64_t h;
+    for (;;) {
+        h = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        if (h - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= RING_SLOTS) {
+            msg_flush();
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&ring_head, &h, h + 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return &ring[h % RING_SLOTS];
+    }
+}
+
+/* "[time] pre<fmt>: suf\n" into buf (at most size); returns the full length */
+static size_t format(char *buf, size_t size, uint64_t ts,
+        const char *pre, const char *suf, const char *fmt, va_list ap)
+{
+    size_t n = 0;
+    int r;
+
+#define ROOM (n < size ? size - n : 0)
+#define PUT(S) do { \
+        size_t l_ = strlen(S); \
+        if (l_ <= ROOM) memcpy(buf + n, S, l_); \
+        else if (ROOM) memcpy(buf + n, S, ROOM); \
+        n += l_; \
+    } while (0)
+
+    if (log_time) {
+        r = snprintf(buf, size, "[%llu.%06llu] ", (unsigned long long)(ts / 1000000000),
+                (unsigned long long)(ts / 1000 % 1000000));
+        n += r > 0 ? r : 0;
+    }
+    if (pre)
+        PUT(pre);
+    r = vsnprintf(ROOM ? buf + n : NULL, ROOM, fmt, ap);
+    n += r > 0 ? r : 0;
+    if (suf) {
+        PUT(": ");
+        PUT(suf);
+    }
+    PUT("\n");
+    return n;
+#undef PUT
+#undef ROOM
+}
+
+static void vlog(int level, const char *pre, const char *suf,
+        const char *fmt, va_list ap)
+{
+    if (!log_enabled(level))
+        return;
+
+    uint64_t ts = log_time ? now_ns() : 0;
+    struct slot *s = claim();
+    va_list ap2;
+
+    va_copy(ap2, ap);
+    size_t len = format(s->text, sizeof(s->text), ts, pre, suf, fmt, ap);
+    if (len > sizeof(s->text) && (s->big = malloc(len + 1)))
+        format(s->big, len + 1, ts, pre, suf, fmt, ap2);
+    else if (len > sizeof(s->text))
+        len = sizeof(s->text);
+    va_end(ap2);
+    s->len = len;
+    __atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+
+    if (!log_defer || level == LOG_FATAL)
+        msg_flush();
+}
+
+/* unbuffered; kept for callers that pick their own stream */
 void vfmsg(FILE *f,
         const char *pre, const char *suf, const char *fmt,
         va_list ap) {
-    int prelen = 0, fmtlen = 0, suflen = 0;
-    if (pre) prelen = strlen(pre);
-    if (fmt) fmtlen = strlen(fmt);
-    if (suf) suflen = strlen(suf);
-    char *newfmt = malloc(
-            prelen*2 + /* %-doubled pre */
-            fmtlen +
-            2 + /* ':' and SP */
-            suflen*2 + /* %-doubled suf */
-            2 /* NL and NUL */
-            );
-    if (!newfmt)
-        goto finish;
-
-    char *newfmt_end = newfmt;
-    if (prelen)
-        while(*pre)
-            if ((*newfmt_end++ = *pre++) == '%')
-                *newfmt_end++ = '%';
-    if (fmtlen) {
-        strcpy(newfmt_end, fmt);
-        newfmt_end += fmtlen;
-    }
-    if (suflen) {
-        *newfmt_end++ = ':';
-        *newfmt_end++ = ' ';
-        while (*suf)
-            if ((*newfmt_end++ = *suf++) == '%')
-                *newfmt_end++ = '%';
+    char buf[SLOT_SIZE], *p = buf;
+    va_list ap2;
+
+    va_copy(ap2, ap);
+    size_t len = format(buf, sizeof(buf), 0, pre, suf, fmt, ap);
+    if (len > sizeof(buf) && (p = malloc(len + 1)))
+        format(p, len + 1, 0, pre, suf, fmt, ap2);
+    else if (len > sizeof(buf)) {
+        p = buf;
+        len = sizeof(buf);
     }
-    *newfmt_end++ = '\n';
-    *newfmt_end++ = '\0';
-    fmt = newfmt;
+    va_end(ap2);
 
-finish:
-    vfprintf(f, fmt, ap);
+    struct iovec iov = { p, len };
     fflush(f);
-
-    if (newfmt)
-        free(newfmt);
+    write_iov(fileno(f), &iov, 1);
+    if (p != buf)
+        free(p);
 }
 
-FILE *msgout = NULL;
-
 void vmsg(const char *pre, const char *suf, const char *fmt, va_list ap) {
-    vfmsg(msgout ? msgout : stderr, pre, suf, fmt, ap);
+    int level = LOG_INFO;
+    if (pre && !strcmp(pre, "fatal: "))
+        level = LOG_FATAL;
+    else if (pre && !strcmp(pre, "warning: "))
+        level = LOG_WARNING;
+    vlog(level, pre, suf, fmt, ap);
 }
 
 void msg(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vmsg(NULL, NULL, fmt, ap);
+    vlog(LOG_INFO, NULL, NULL, fmt, ap);
+    va_end(ap);
+}
+
+void debug(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vlog(LOG_DEBUG, "debug: ", NULL, fmt, ap);
     va_end(ap);
 }
 
 void warn(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vmsg("warning: ", NULL, fmt, ap);
+    vlog(LOG_WARNING, "warning: ", NULL, fmt, ap);
     va_end(ap);
 }
 
@@ -106,7 +290,7 @@ void warn_errno(const char *fmt, ...) {
     int err = errno; /* just in case it gets clobbered */
     va_list ap;
     va_start(ap, fmt);
-    vmsg("warning: ", strerror(err), fmt, ap);
+    vlog(LOG_WARNING, "warning: ", strerror(err), fmt, ap);
     va_end(ap);
     errno = err;
 }
@@ -114,7 +298,7 @@ void warn_errno(const char *fmt, ...) {
 void die(int ev, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vmsg("fatal: ", NULL, fmt, ap);
+    vlog(LOG_FATAL, "fatal: ", NULL, fmt, ap);
     va_end(ap);
     exit(ev);
 }
@@ -123,7 +307,7 @@ void die_errno(int ev, const char *fmt, ...) {
     int err = errno; /* just in case it gets clobbered */
     va_list ap;
     va_start(ap, fmt);
-    vmsg("fatal: ", strerror(err), fmt, ap);
+    vlog(LOG_FATAL, "fatal: ", strerror(err), fmt, ap);
     va_end(ap);
     exit(ev);
 }
@@ -38,7 +38,9 @@ void vfmsg(FILE *f,
 extern FILE *msgout;
 void vmsg(const char *pre, const char *suf, const char *fmt, va_list ap);
 void msg(const char *fmt, ...);
+void debug(const char *fmt, ...);
 void warn(const char *fmt, ...);
 void warn_errno(const char *fmt, ...);
 void die(int ev, const char *fmt, ...) __attribute__((noreturn));
 void die_errno(int ev, const char *fmt, ...) __attribute__((noreturn));
+void msg_flush(void);
@@ -0,0 +1,556 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "msg.h"
+#include "normalize.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define HAVE_X86_VECTORS 1
+#include <immintrin.h>
+#endif
+
+/*
+ * The optional --copy normalization: invalid UTF-8 replaced with
+ * U+FFFD (or refused), "\r\n" line endings turned into "\n", and
+ * spaces and tabs stripped from the ends of lines, in one pass over
+ * the input as it streams in.
+ *
+ * Almost all of the input is text that none of these touch. It is
+ * found a vector at a time (AVX2 where the CPU has it, else SSE2, else
+ * eight bytes at a time in a plain word) by looking only for the bytes
+ * that the chosen options care about: any byte with its high bit set
+ * (for UTF-8), '\r' (for CRLF) and a '\n' that follows a blank (for
+ * trimming). Runs between
+ * them are copied out whole, or, if long, handed on without a copy at
+ * all; only the bytes found take the slow path. A multi-byte character
+ * is checked there, so text that is mostly non-ASCII runs well below
+ * the ASCII rate.
+ *
+ * Trailing whitespace is trimmed by backing up over it in the output
+ * when a '\n' (or the end of the input) arrives, which is why whatever
+ * whitespace the output ends with is held back when it is emitted.
+ * When a whole buffer of it is waiting, the spaces and tabs go into a
+ * short run-length list instead (replayed if text follows, dropped if
+ * the line ends), so a long blank tail costs no memory. One that
+ * switches between spaces and tabs more often than the list holds is
+ * passed on untrimmed.
+ */
+
+#define OUT_SIZE (64 * 1024)
+#define DIRECT_MIN 4096     /* runs this long are emitted from the input */
+
+enum { UTF8_VALID, UTF8_INVALID, UTF8_SHORT };
+
+/*
+ * The bytes scan stops at: with hi, any byte >= 0x80; with cr, '\r';
+ * with nl, a '\n' right after a space, tab or '\r' (the only ones
+ * trimming has anything to do for), and, not knowing what came
+ * before, one that starts the data.
+ */
+struct specials {
+    int hi, cr, nl;
+};
+
+static int blank(unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int special(const unsigned char *p, size_t i, const struct specials *s)
+{
+    return (s->hi && p[i] & 0x80) || (s->cr && p[i] == '\r') ||
+        (s->nl && p[i] == '\n' && (!i || blank(p[i - 1])));
+}
+
+static size_t scan_word(const unsigned char *p, size_t len, const struct specials *s)
+{
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    const uint64_t hi = s->hi ? highs : 0, cr = s->cr ? highs : 0, nl = s->nl ? highs : 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w, x, y;
+        memcpy(&w, p + i, sizeof(w));
+        x = w ^ (ones * '\r');
+        y = w ^ (ones * '\n');
+        /* any '\n' at all sends the word to the exact check below */
+        if ((w & hi) | ((x - ones) & ~x & cr) | ((y - ones) & ~y & nl)) {
+            size_t j;
+            for (j = i; j < i + 8; j++)
+                if (special(p, j, s))
+                    return j;
+        }
+    }
+    for (; i < len; i++)
+        if (special(p, i, s))
+            break;
+    return i;
+}
+
+#ifdef HAVE_X86_VECTORS
+static size_t scan_sse2(const unsigned char *p, size_t len, const struct specials *s)
+{
+    const __m128i cr = _mm_set1_epi8('\r'), nl = _mm_set1_epi8('\n');
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    const unsigned int hi_mask = s->hi ? 0xffff : 0, cr_mask = s->cr ? 0xffff : 0;
+    const unsigned int nl_mask = s->nl ? 0xffff : 0;
+    size_t i = 1;
+
+    if (!len || special(p, 0, s))
+        return 0;
+    /* each byte is looked at with the one before it */
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i prev = _mm_loadu_si128((const __m128i *)(p + i - 1));
+        __m128i after_blank = _mm_and_si128(_mm_cmpeq_epi8(v, nl),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(prev, sp),
+                        _mm_cmpeq_epi8(prev, tab)), _mm_cmpeq_epi8(prev, cr)));
+        unsigned int m = ((unsigned int)_mm_movemask_epi8(v) & hi_mask) |
+            ((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)) & cr_mask) |
+            ((unsigned int)_mm_movemask_epi8(after_blank) & nl_mask);
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    for (; i < len; i++)
+        if (special(p, i, s))
+            break;
+    return i;
+}
+
+__attribute__ ((target ("avx2")))
+static size_t scan_avx2(const unsigned char *p, size_t len, const struct specials *s)
+{
+    const __m256i cr = _mm256_set1_epi8('\r'), nl = _mm256_set1_epi8('\n');
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+    const unsigned int hi_mask = s->hi ? 0xffffffffU : 0, cr_mask = s->cr ? 0xffffffffU : 0;
+    const unsigned int nl_mask = s->nl ? 0xffffffffU : 0;
+    size_t i = 1;
+
+    if (!len || special(p, 0, s))
+        return 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i prev = _mm256_loadu_si256((const __m256i *)(p + i - 1));
+        __m256i after_blank = _mm256_and_si256(_mm256_cmpeq_epi8(v, nl),
+                _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(prev, sp),
+                        _mm256_cmpeq_epi8(prev, tab)), _mm256_cmpeq_epi8(prev, cr)));
+        unsigned int m = ((unsigned int)_mm256_movemask_epi8(v) & hi_mask) |
+            ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr)) & cr_mask) |
+            ((unsigned int)_mm256_movemask_epi8(after_blank) & nl_mask);
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    for (; i < len; i++)
+        if (special(p, i, s))
+            break;
+    return i;
+}
+#endif
+
+typedef size_t scan_func(const unsigned char *p, size_t len, const struct specials *s);
+
+static const struct {
+    const char *name;
+    scan_func *scan;
+} kernels[] = {
+#ifdef HAVE_X86_VECTORS
+    { "avx2", scan_avx2 },
+    { "sse2", scan_sse2 },
+#endif
+    { "word", scan_word },
+};
+
+static unsigned int kernel;
+
+/* the fastest the CPU has, unless REATTACH_NORMALIZE_KERNEL names another */
+static scan_func *pick_scan(void)
+{
+    const char *want = getenv("REATTACH_NORMALIZE_KERNEL");
+    unsigned int i;
+
+    for (i = 0; want && i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if (!strcmp(want, kernels[i].name))
+            return kernels[kernel = i].scan;
+#ifdef HAVE_X86_VECTORS
+    __builtin_cpu_init();
+    kernel = __builtin_cpu_supports("avx2") ? 0 : 1;
+#endif
+    return kernels[kernel].scan;
+}
+
+/*
+ * s[0] >= 0x80. *used is the length of the sequence, or (invalid) of
+ * the longest prefix of one that it starts with (at least 1), or
+ * (short: avail ran out first) of what there was.
+ */
+static int utf8_check(const unsigned char *s, size_t avail, size_t *used)
+{
+    unsigned char lo = 0x80, hi = 0xbf, c = s[0];
+    size_t need, i;
+
+    if (c >= 0xc2 && c <= 0xdf)
+        need = 2;
+    else if (c >= 0xe0 && c <= 0xef) {
+        need = 3;
+        if (c == 0xe0)
+            lo = 0xa0;          /* overlong */
+        else if (c == 0xed)
+            hi = 0x9f;          /* surrogates */
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        need = 4;
+        if (c == 0xf0)
+            lo = 0x90;          /* overlong */
+        else if (c == 0xf4)
+            hi = 0x8f;          /* past U+10FFFF */
+    } else {
+        *used = 1;
+        return UTF8_INVALID;
+    }
+
+    for (i = 1; i < need; i++) {
+        if (i == avail) {
+            *used = i;
+            return UTF8_SHORT;
+        }
+        if (s[i] < lo || s[i] > hi) {
+            *used = i;
+            return UTF8_INVALID;
+        }
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    *used = need;
+    return UTF8_VALID;
+}
+
+
+/* emit the held blank runs: text follows them */
+static int replay(struct normalize *n)
+{
+    char buf[4096];
+    unsigned int i;
+
+    for (i = 0; i < n->nheld; i++) {
+        uint64_t left = n->held[i].n;
+        memset(buf, n->held[i].c, sizeof(buf));
+        while (left) {
+            size_t len = left < sizeof(buf) ? left : sizeof(buf);
+            if (n->emit(n->ctx, buf, len))
+                return -1;
+            left -= len;
+        }
+    }
+    n->nheld = 0;
+    return 0;
+}
+
+/* the line ends with the held runs (and whatever blanks follow them) */
+static void drop_held(struct normalize *n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n->nheld; i++)
+        n->trimmed += n->held[i].n;
+    n->nheld = 0;
+}
+
+/*
+ * The buffer is full of blanks. What comes before the ones that a
+ * line end could still trim can go; the spaces and tabs are moved to
+ * the held runs, and only a final '\r' stays.
+ */
+static int hold(struct normalize *n)
+{
+    size_t end = n->len, start, i;
+
+    if (n->out[end - 1] == '\r')
+        end--;
+    for (start = end; start && (n->out[start - 1] == ' ' ||
+                n->out[start - 1] == '\t'); start--)
+        ;
+    if (start && (replay(n) || n->emit(n->ctx, n->out, start)))
+        return -1;
+    for (i = start; i < end; i++) {
+        struct normalize_run *r;
+        if (n->nheld && n->held[n->nheld - 1].c == n->out[i]) {
+            n->held[n->nheld - 1].n++;
+            continue;
+        }
+        if (n->nheld == NORMALIZE_RUNS) {
+            /* too mixed to hold: give up trimming it */
+            if (replay(n) || n->emit(n->ctx, n->out + i, end - i))
+                return -1;
+            break;
+        }
+        r = &n->held[n->nheld++];
+        r->c = n->out[i];
+        r->n = 1;
+    }
+    memmove(n->out, n->out + end, n->len - end);
+    n->len -= end;
+    return 0;
+}
+
+/* emit what is buffered; all of it with all set, else all but the trailing whitespace */
+static int flush(struct normalize *n, int all)
+{
+    size_t keep = n->len;
+
+    if (!all && (n->flags & NORMALIZE_TRIM))
+        while (keep && blank(n->out[keep - 1]))
+            keep--;
+    if ((keep || all) && n->nheld && replay(n))
+        return -1;
+    if (keep && n->emit(n->ctx, n->out, keep))
+        return -1;
+    memmove(n->out, n->out + keep, n->len - keep);
+    n->len -= keep;
+
+    /* nothing but whitespace: it can only wait for what follows */
+    if (n->len == n->alloc)
+        return hold(n);
+    return 0;
+}
+
+static int put(struct normalize *n, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len) {
+        size_t space = n->alloc - n->len;
+        if (!space) {
+            if (flush(n, 0))
+                return -1;
+            continue;
+        }
+        if (space > len)
+            space = len;
+        memcpy(n->out + n->len, p, space);
+        n->len += space;
+        p += space;
+        len -= space;
+    }
+    return 0;
+}
+
+/* a run with none of the bytes we look for: long ones skip the buffer */
+static int put_run(struct normalize *n, const unsigned char *p, size_t len)
+{
+    if (len >= DIRECT_MIN) {
+        size_t keep = len;
+        if (n->flags & NORMALIZE_TRIM)
+            while (keep && blank(p[keep - 1]))
+                keep--;
+        /* what is buffered is followed by text now, so it can all go */
+        if (keep && (flush(n, 1) || n->emit(n->ctx, (const char *)p, keep)))
+            return -1;
+        p += keep;
+        len -= keep;
+    }
+    return put(n, p, len);
+}
+
+/* the line being built ends here: drop its trailing spaces and tabs */
+static void trim(struct normalize *n)
+{
+    size_t end = n->len, start;
+    int cr = 0;
+
+    if (end && n->out[end - 1] == '\r') {
+        cr = 1;
+        end--;
+    }
+    for (start = end; start && (n->out[start - 1] == ' ' ||
+                n->out[start - 1] == '\t'); start--)
+        ;
+    if (!start)
+        drop_held(n);
+    if (start == end)
+        return;
+    n->trimmed += end - start;
+    if (cr)
+        n->out[start++] = '\r';
+    n->len = start;
+}
+
+static int invalid(struct normalize *n, uint64_t at)
+{
+    if (n->flags & NORMALIZE_UTF8_STRICT) {
+        warn("copy: invalid UTF-8 at byte %llu", (unsigned long long)at);
+        return -1;
+    }
+    n->replaced++;
+    return put(n, "\xef\xbf\xbd", 3);
+}
+
+static scan_func *scan;
+
+/* parse a comma separated list of utf8, utf8-strict, crlf and trim ("": all but strict) */
+int normalize_flags(const char *spec, unsigned int *flags)
+{
+    static const struct {
+        const char *name;
+        unsigned int flag;
+    } names[] = {
+        { "utf8", NORMALIZE_UTF8 },
+        { "utf8-strict", NORMALIZE_UTF8_STRICT },
+        { "crlf", NORMALIZE_CRLF },
+        { "trim", NORMALIZE_TRIM },
+    };
+    size_t i, len;
+
+    *flags = 0;
+    if (!*spec) {
+        *flags = NORMALIZE_UTF8 | NORMALIZE_CRLF | NORMALIZE_TRIM;
+        return 0;
+    }
+    while (*spec) {
+        len = strcspn(spec, ",");
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+            if (strlen(names[i].name) == len && !strncmp(spec, names[i].name, len))
+                break;
+        if (i == sizeof(names) / sizeof(names[0]))
+            return -1;
+        *flags |= names[i].flag;
+        spec += len;
+        if (*spec)
+            spec++;
+    }
+    return 0;
+}
+
+int normalize_init(struct normalize *n, unsigned int flags,
+        normalize_emit *emit, void *ctx)
+{
+    memset(n, 0, sizeof(*n));
+    n->flags = flags;
+    n->emit = emit;
+    n->ctx = ctx;
+    n->alloc = OUT_SIZE;
+    if (!(n->out = malloc(n->alloc))) {
+        warn("out of memory");
+        return -1;
+    }
+    if (!scan)
+        scan = pick_scan();
+    return 0;
+}
+
+int normalize_update(struct normalize *n, const char *data, size_t len)
+{
+    const unsigned char *start = (const unsigned char *)data, *p = start;
+    const unsigned char *end = p + len;
+    const int utf8 = n->flags & (NORMALIZE_UTF8 | NORMALIZE_UTF8_STRICT);
+    const int crlf = n->flags & NORMALIZE_CRLF, trims = n->flags & NORMALIZE_TRIM;
+    const struct specials sp = { utf8 != 0, crlf != 0, trims != 0 };
+    uint64_t base = n->in;
+    size_t used = 1;
+    int r = UTF8_VALID;
+
+    if (!len)
+        return 0;
+    n->in += len;
+
+    if (n->npartial) {
+        /* finish the character the last chunk cut off */
+        unsigned char tmp[4];
+        size_t have = n->npartial, take = len < 4 - have ? len : 4 - have;
+
+        memcpy(tmp, n->partial, have);
+        memcpy(tmp + have, p, take);
+        r = utf8_check(tmp, have + take, &used);
+        if (r == UTF8_SHORT) {
+            memcpy(n->partial + have, p, take);
+            n->npartial += take;
+            return 0;
+        }
+        n->npartial = 0;
+        if (r == UTF8_VALID ? put(n, tmp, used) : invalid(n, base - have))
+            return -1;
+        p += used - have;
+    } else if (n->cr) {
+        /* a '\r' ended the last chunk; if this one starts with '\n' it goes */
+        n->cr = 0;
+        if (*p == '\n')
+            n->crlf++;
+        else if (put(n, "\r", 1))
+            return -1;
+    }
+
+    while (p < end) {
+        size_t run = scan(p, end - p, &sp);
+
+        if (run && put_run(n, p, run))
+            return -1;
+        p += run;
+        if (p == end)
+            break;
+
+        if (*p & 0x80) {
+            const unsigned char *from = p;
+            while (p < end && *p & 0x80 &&
+                    (r = utf8_check(p, end - p, &used)) == UTF8_VALID)
+                p += used;
+            if (p > from && put(n, from, p - from))
+                return -1;
+            if (p == end || !(*p & 0x80))
+                continue;
+            if (r == UTF8_SHORT) {
+                memcpy(n->partial, p, end - p);
+                n->npartial = end - p;
+                break;
+            }
+            if (invalid(n, base + (p - start)))
+                return -1;
+            p += used;
+        } else if (*p == '\r') {
+            if (p + 1 == end) {
+                n->cr = 1;
+                break;
+            }
+            if (p[1] == '\n')
+                n->crlf++;
+            else if (put(n, "\r", 1))
+                return -1;
+            p++;
+        } else {
+            trim(n);
+            if (put(n, "\n", 1))
+                return -1;
+            p++;
+        }
+    }
+    return 0;
+}
+
+/* the input is complete: settle what was held back and emit the rest */
+int normalize_final(struct normalize *n)
+{
+    if (n->npartial) {
+        uint64_t at = n->in - n->npartial;
+        n->npartial = 0;
+        if (invalid(n, at))
+            return -1;
+    }
+    if (n->cr) {
+        n->cr = 0;
+        if (put(n, "\r", 1))
+            return -1;
+    }
+    if (n->flags & NORMALIZE_TRIM)
+        trim(n);
+    return flush(n, 1);
+}
+
+const char *normalize_kernel(void)
+{
+    if (!scan)
+        scan = pick_scan();
+    return kernels[kernel].name;
+}
+
+void normalize_free(struct normalize *n)
+{
+    free(n->out);
+    n->out = NULL;
+}
@@ -0,0 +1,42 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* what --copy does to its input on the way to the clipboard; see normalize.c */
+#define NORMALIZE_UTF8          1   /* invalid UTF-8 becomes U+FFFD */
+#define NORMALIZE_UTF8_STRICT   2   /* invalid UTF-8 fails the copy */
+#define NORMALIZE_CRLF          4   /* "\r\n" becomes "\n" */
+#define NORMALIZE_TRIM          8   /* no spaces or tabs at the end of a line */
+
+/* receives the normalized text in pieces; nonzero stops with an error */
+typedef int normalize_emit(void *ctx, const char *data, size_t len);
+
+/* a run of n spaces or tabs (c) */
+struct normalize_run {
+    char c;
+    uint64_t n;
+};
+
+#define NORMALIZE_RUNS 32
+
+struct normalize {
+    unsigned int flags;
+    normalize_emit *emit;
+    void *ctx;
+    char *out;                  /* normalized, not yet emitted */
+    size_t len, alloc;
+    unsigned char partial[4];   /* a UTF-8 sequence cut off by the last chunk */
+    unsigned int npartial;
+    int cr;                     /* ... or the '\r' of what may be "\r\n" */
+    struct normalize_run held[NORMALIZE_RUNS];  /* blanks ahead of out, held back */
+    unsigned int nheld;
+    uint64_t in;                /* bytes taken so far */
+    uint64_t replaced, crlf, trimmed;
+};
+
+int normalize_flags(const char *spec, unsigned int *flags);
+int normalize_init(struct normalize *n, unsigned int flags,
+        normalize_emit *emit, void *ctx);
+int normalize_update(struct normalize *n, const char *data, size_t len);
+int normalize_final(struct normalize *n);
+void normalize_free(struct normalize *n);
+const char *normalize_kernel(void);
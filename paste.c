@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "msg.h"
+#include "clip.h"
+#include "paste.h"
+#include "paste_cache.h"
+#include "sanitize.h"
+
+/*
+ * --paste: write the clipboard contents to out.
+ *
+ * A source that hands out an fd is moved in the kernel where that is
+ * possible (Linux: splice from a pipe, sendfile from anything else);
+ * otherwise, and for sources that hand out memory, it is copied with
+ * large writes. When the paste cache is on and misses, the contents
+ * are always copied through memory so they can be kept as well.
+ *
+ * With REATTACH_PASTE_SANITIZE set ("strip", the default, or "escape"),
+ * everything written, cache hits included, goes through sanitize.c
+ * first, and so through memory. The cache keeps what the source gave.
+ */
+
+#define COPY_SIZE (1024 * 1024)
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* out, and the sanitizer in front of it if there is one */
+struct paste_out {
+    int fd;
+    struct sanitize *san;
+};
+
+static int emit_fd(void *ctx, const char *data, size_t len)
+{
+    const struct paste_out *o = ctx;
+    return write_all(o->fd, data, len);
+}
+
+static int put_out(void *ctx, const void *data, size_t len)
+{
+    const struct paste_out *o = ctx;
+    return o->san ? sanitize_update(o->san, data, len) : write_all(o->fd, data, len);
+}
+
+static int copy_rw(struct paste_out *out, int in, struct paste_cache *pc)
+{
+    char *buf = malloc(COPY_SIZE);
+    int r = -1;
+
+    if (!buf) {
+        warn("out of memory");
+        return -1;
+    }
+    for (;;) {
+        ssize_t n = read(in, buf, COPY_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            warn_errno("paste: read failed");
+            break;
+        }
+        if (!n) {
+            r = 0;
+            break;
+        }
+        if (put_out(out, buf, n)) {
+            warn_errno("paste: write failed");
+            break;
+        }
+        paste_cache_add(pc, buf, n);
+    }
+    free(buf);
+    return r;
+}
+
+#ifdef __linux__
+/*
+ * 1 if the kernel moved everything, 0 if it could not start (use
+ * read/write instead), -1 on error after some data was moved.
+ */
+static int copy_kernel(int out, int in)
+{
+    struct stat st;
+    int moved = 0;
+
+    if (fstat(in, &st))
+        return 0;
+    for (;;) {
+        ssize_t n;
+        if (S_ISFIFO(st.st_mode))
+            n = splice(in, NULL, out, NULL, COPY_SIZE, SPLICE_F_MOVE|SPLICE_F_MORE);
+        else
+            n = sendfile(out, in, NULL, COPY_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            if (!moved && (errno == EINVAL || errno == ENOSYS))
+                return 0;
+            warn_errno("paste: %s failed", S_ISFIFO(st.st_mode) ? "splice" : "sendfile");
+            return -1;
+        }
+        if (!n)
+            return 1;
+        moved = 1;
+    }
+}
+#endif
+
+static int paste(struct paste_out *out)
+{
+    const struct clip_source *src = clip_source();
+    struct paste_cache pc;
+    int r;
+
+    if (!src)
+        return 1;
+    r = paste_cache_open(&pc, clip_generation(src),
+            src->change_count ? src->change_count() : -1, put_out, out);
+    if (r)
+        return r > 0 ? 0 : 1;
+
+    if (src->get) {
+        size_t len;
+        const void *data = src->get(&len);
+        if (!data) {
+            paste_cache_close(&pc, 0);
+            return 1;
+        }
+        if (put_out(out, data, len)) {
+            warn_errno("paste: write failed");
+            paste_cache_close(&pc, 0);
+            return 1;
+        }
+        paste_cache_add(&pc, data, len);
+        paste_cache_close(&pc, 1);
+        return 0;
+    }
+
+    int in = src->open();
+    if (in < 0) {
+        paste_cache_close(&pc, 0);
+        return 1;
+    }
+#ifdef __linux__
+    r = pc.fd < 0 && !out->san ? copy_kernel(out->fd, in) : 0;
+    if (!r)
+        r = copy_rw(out, in, &pc);
+    else
+        r = r > 0 ? 0 : -1;
+#else
+    r = copy_rw(out, in, &pc);
+#endif
+    close(in);
+    paste_cache_close(&pc, !r);
+    return r ? 1 : 0;
+}
+
+int paste_main(int fd)
+{
+    const char *sanitize = getenv("REATTACH_PASTE_SANITIZE");
+    struct paste_out out = { fd, NULL };
+    struct sanitize san;
+    int mode, r;
+
+    if (sanitize) {
+        if (sanitize_mode(sanitize, &mode)) {
+            warn("paste: bad REATTACH_PASTE_SANITIZE: %s", sanitize);
+            return 1;
+        }
+        if (sanitize_init(&san, mode, emit_fd, &out))
+            return 1;
+        out.san = &san;
+    }
+
+    r = paste(&out);
+    if (out.san) {
+        if (!r && sanitize_final(&san)) {
+            warn_errno("paste: write failed");
+            r = 1;
+        }
+        debug("paste: %s %llu controls and %llu escape sequences",
+                mode == SANITIZE_ESCAPE ? "escaped" : "removed",
+                (unsigned long long)san.controls, (unsigned long long)san.sequences);
+        sanitize_free(&san);
+    }
+    return r;
+}
@@ -0,0 +1 @@
+int paste_main(int out);
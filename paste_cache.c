@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "msg.h"
+#include "paste_cache.h"
+#include "user_path.h"
+
+/*
+ * With REATTACH_PASTE_CACHE set, --paste keeps the last contents it
+ * read in "paste-cache" in the per-user directory, labelled with the
+ * source's change count and generation (see clip_generation). While
+ * both stay the same, later pastes are answered from an mmap of that
+ * file without reading the source at all, so polling the clipboard
+ * costs a count check instead of a full copy out of the pasteboard.
+ *
+ * REATTACH_PASTE_CACHE is the largest contents (in bytes) worth
+ * keeping; an empty value means 8 MiB. A new entry is written next to
+ * the old one and renamed over it, so readers see one or the other.
+ * The count is read before the contents, so contents that change
+ * during a read are at worst labelled with an old count and replaced
+ * by the next paste.
+ */
+
+#define CACHE_MAGIC 0x72747063 /* "rtpc" */
+#define DEFAULT_MAX (8 * 1024 * 1024)
+
+struct cache_head {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t generation;
+    int64_t count;
+    uint64_t len;
+    uint64_t hits, misses;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* the current entry's head (mapped with its contents), or NULL */
+static struct cache_head *cache_map(size_t *size)
+{
+    char path[PATH_MAX];
+    struct cache_head *h;
+    struct stat st;
+    int fd;
+
+    if (user_path(path, sizeof(path), "paste-cache"))
+        return NULL;
+    if ((fd = open(path, O_RDWR)) < 0)
+        return NULL;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        return NULL;
+    }
+    h = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        return NULL;
+    if (h->magic != CACHE_MAGIC || h->len != st.st_size - sizeof(*h)) {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return h;
+}
+
+/*
+ * Look for count, taken under generation, in the cache. On a hit the contents are given to
+ * out and 1 is returned (-1 if that write failed). On a miss 0 is
+ * returned and, unless caching is off, pc is ready to collect the new
+ * contents with paste_cache_add.
+ */
+int paste_cache_open(struct paste_cache *pc, uint64_t generation, long count,
+        paste_write *out, void *ctx)
+{
+    const char *opt = getenv("REATTACH_PASTE_CACHE");
+    struct cache_head *h;
+    size_t size;
+
+    memset(pc, 0, sizeof(*pc));
+    pc->fd = -1;
+    if (!opt || count < 0)
+        return 0;
+    pc->count = count;
+    pc->generation = generation;
+    pc->max = *opt ? strtoull(opt, NULL, 0) : DEFAULT_MAX;
+
+    if ((h = cache_map(&size))) {
+        if (h->generation == generation && h->count == count) {
+            int r = out(ctx, h + 1, h->len) ? -1 : 1;
+            uint64_t hits = __atomic_add_fetch(&h->hits, 1, __ATOMIC_RELAXED);
+            debug("paste cache hit: change count %ld, %llu bytes (%llu hits, %llu misses)",
+                    count, (unsigned long long)h->len, (unsigned long long)hits,
+                    (unsigned long long)h->misses);
+            munmap(h, size);
+            if (r < 0)
+                warn_errno("paste: write failed");
+            return r;
+        }
+        if (h->generation != generation)
+            debug("paste cache: entry is from another clipboard or boot");
+        pc->hits = h->hits;
+        pc->misses = h->misses;
+        munmap(h, size);
+    }
+    pc->misses++;
+    debug("paste cache miss: change count %ld", count);
+
+    if (user_path(pc->tmp, sizeof(pc->tmp), "paste-cache.XXXXXX"))
+        return 0;
+    if ((pc->fd = mkstemp(pc->tmp)) < 0)
+        return 0;
+    if (lseek(pc->fd, sizeof(struct cache_head), SEEK_SET) < 0)
+        paste_cache_close(pc, 0);
+    return 0;
+}
+
+/* add data to the entry being filled; gives up on it past the size limit */
+void paste_cache_add(struct paste_cache *pc, const void *data, size_t len)
+{
+    if (pc->fd < 0)
+        return;
+    if (pc->len + len > pc->max || write_all(pc->fd, data, len)) {
+        paste_cache_close(pc, 0);
+        return;
+    }
+    pc->len += len;
+}
+
+/* with ok, make the filled entry the current one; otherwise drop it */
+void paste_cache_close(struct paste_cache *pc, int ok)
+{
+    struct cache_head h = { CACHE_MAGIC, 0, pc->generation, pc->count, pc->len, pc->hits, pc->misses };
+    char path[PATH_MAX];
+
+    if (pc->fd < 0)
+        return;
+    if (ok && (pwrite(pc->fd, &h, sizeof(h), 0) != sizeof(h) ||
+                user_path(path, sizeof(path), "paste-cache") ||
+                rename(pc->tmp, path)))
+        ok = 0;
+    if (!ok)
+        unlink(pc->tmp);
+    close(pc->fd);
+    pc->fd = -1;
+}
@@ -0,0 +1,20 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+struct paste_cache {
+    int fd;             /* the entry being filled; -1 when not caching */
+    char tmp[PATH_MAX];
+    long count;
+    uint64_t generation;
+    uint64_t len, max;
+    uint64_t hits, misses;
+};
+
+/* where a hit goes; nonzero (with errno set) if it could not be written */
+typedef int paste_write(void *ctx, const void *data, size_t len);
+
+int paste_cache_open(struct paste_cache *pc, uint64_t generation, long count,
+        paste_write *out, void *ctx);
+void paste_cache_add(struct paste_cache *pc, const void *data, size_t len);
+void paste_cache_close(struct paste_cache *pc, int ok);
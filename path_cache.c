@@ -0,0 +1,304 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "msg.h"
+#include "path_cache.h"
+#include "timing.h"
+#include "trace.h"
+#include "user_path.h"
+
+/*
+ * With REATTACH_PATH_CACHE set, remember where the PATH search for a
+ * program ended so that later launches can exec it directly instead of
+ * letting execvp try every directory in front of it.
+ *
+ * Entries live in "exec-cache" in the per-user directory, an mmap'd
+ * table keyed on (PATH, program). Each records the resolved path and a
+ * hash of the identity and mtime of every PATH directory up to the one
+ * it was found in: adding or removing a program in any of them changes
+ * its mtime, so a hit only needs a stat of each of those directories.
+ * REATTACH_PATH_CACHE is a number of seconds: an entry checked that
+ * recently is trusted without statting anything (0 always checks).
+ *
+ * On a miss the walk is done here (as execvp would) and recorded;
+ * anything unusual (relative PATH entries, a failed exec) is left to
+ * execvp.
+ *
+ * Writers claim an entry by putting their pid in it, and mark it busy
+ * with an odd sequence number while they fill it in; readers that see
+ * an odd or changed sequence treat the entry as a miss. A writer that
+ * died part way would leave the entry busy for good, so a claim whose
+ * pid no longer exists is taken over by the next writer.
+ *
+ * The header counts hits, misses and the PATH walk time that hits
+ * avoided; they are shown with REATTACH_LOG_LEVEL=debug.
+ */
+
+#define CACHE_MAGIC 0x72747064 /* "rtpd" ("rtpc" had no writer) */
+#define CACHE_ENTRIES 64
+#define MAX_FILE 64
+#define MAX_RESOLVED 448
+
+struct cache_entry {
+    uint32_t seq;
+    uint32_t writer;            /* pid filling it in, 0 if none */
+    uint32_t ndirs;             /* directories hashed into dirs_hash */
+    uint64_t key;
+    uint64_t dirs_hash;
+    uint64_t walk_ns;           /* what the PATH walk cost when it missed */
+    uint64_t checked;           /* time() dirs_hash was last found good */
+    char file[MAX_FILE];
+    char resolved[MAX_RESOLVED];
+};
+
+struct cache_file {
+    uint32_t magic;
+    uint32_t entries;
+    uint64_t hits, misses, stale;
+    uint64_t saved_ns;
+    struct cache_entry entry[CACHE_ENTRIES];
+};
+
+static uint64_t fnv(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *c = p;
+    while (len--)
+        h = (h ^ *c++) * 0x100000001b3ULL;
+    return h;
+}
+
+#define FNV_INIT 0xcbf29ce484222325ULL
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+/* fold directory d (of length len) into h */
+static uint64_t hash_dir(uint64_t h, const char *d, size_t len)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+    uint64_t v[4] = { 0, 0, 0, 0 };
+
+    if (len >= sizeof(dir))
+        return fnv(h, "?", 1);
+    memcpy(dir, d, len);
+    dir[len] = '\0';
+    if (!stat(dir, &st)) {
+        v[0] = st.st_dev;
+        v[1] = st.st_ino;
+        v[2] = st.st_mtime;
+        v[3] = MTIME_NSEC(st);
+    }
+    return fnv(h, v, sizeof(v));
+}
+
+/* the hash of the first n directories of path */
+static uint64_t hash_dirs(const char *path, unsigned int n)
+{
+    uint64_t h = FNV_INIT;
+    const char *p = path;
+
+    while (n--) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        h = hash_dir(h, p, len);
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return h;
+}
+
+/*
+ * The PATH walk execvp would do, stopping at the first regular,
+ * executable file. Sets *ndirs to the number of directories looked at.
+ * Returns -1 if it is not found or if PATH has a relative directory
+ * (that answer would depend on the working directory).
+ */
+static int walk(const char *path, const char *file, char *out, size_t size,
+        unsigned int *ndirs)
+{
+    const char *p = path;
+    unsigned int n = 0;
+
+    for (;;) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        struct stat st;
+        int r;
+
+        n++;
+        if (!len || *p != '/')
+            return -1;
+        r = snprintf(out, size, "%.*s/%s", (int)len, p, file);
+        if (r > 0 && (size_t)r < size && !stat(out, &st) &&
+                S_ISREG(st.st_mode) && !access(out, X_OK)) {
+            *ndirs = n;
+            return 0;
+        }
+        if (!end)
+            return -1;
+        p = end + 1;
+    }
+}
+
+static struct cache_file *cache_map(void)
+{
+    char path[PATH_MAX];
+    struct cache_file *c;
+    struct stat st;
+    int fd;
+
+    if (user_path(path, sizeof(path), "exec-cache"))
+        return NULL;
+    if ((fd = open(path, O_RDWR|O_CREAT, 0600)) < 0)
+        return NULL;
+    if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(*c) &&
+                ftruncate(fd, sizeof(*c)))) {
+        close(fd);
+        return NULL;
+    }
+    c = mmap(NULL, sizeof(*c), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c == MAP_FAILED)
+        return NULL;
+
+    /* a new (zero filled) or foreign file: claim it */
+    if (c->magic != CACHE_MAGIC || c->entries != CACHE_ENTRIES) {
+        memset(c, 0, sizeof(*c));
+        c->entries = CACHE_ENTRIES;
+        __atomic_store_n(&c->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+    }
+    return c;
+}
+
+/* copy e's answer out if it is for key/file and was not being rewritten */
+static int entry_read(struct cache_entry *e, uint64_t key, const char *file,
+        char *resolved, unsigned int *ndirs, uint64_t *dirs_hash,
+        uint64_t *walk_ns, uint64_t *checked)
+{
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1 || e->key != key || strncmp(e->file, file, MAX_FILE))
+        return -1;
+    memcpy(resolved, e->resolved, MAX_RESOLVED);
+    *ndirs = e->ndirs;
+    *dirs_hash = e->dirs_hash;
+    *walk_ns = e->walk_ns;
+    *checked = e->checked;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+        return -1;
+    resolved[MAX_RESOLVED-1] = '\0';
+    return 0;
+}
+
+/* whether the pid that claimed an entry is gone, leaving it half written */
+static int writer_gone(uint32_t pid)
+{
+    int err = errno, gone = kill(pid, 0) && errno == ESRCH;
+
+    errno = err;
+    return gone;
+}
+
+static void entry_write(struct cache_entry *e, uint64_t key, const char *file,
+        const char *resolved, unsigned int ndirs, uint64_t dirs_hash, uint64_t walk_ns)
+{
+    uint32_t me = getpid(), w = __atomic_load_n(&e->writer, __ATOMIC_RELAXED), seq;
+
+    /* somebody else is writing it; theirs will do, unless they died at it */
+    if ((w && !writer_gone(w)) || !__atomic_compare_exchange_n(&e->writer, &w, me, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    /* (a dead writer's entry is odd already) */
+    seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&e->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    e->key = key;
+    e->ndirs = ndirs;
+    e->dirs_hash = dirs_hash;
+    e->walk_ns = walk_ns;
+    e->checked = time(NULL);
+    strncpy(e->file, file, MAX_FILE);
+    strncpy(e->resolved, resolved, MAX_RESOLVED);
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->writer, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * The absolute path to exec for file (in resolved, which holds size
+ * bytes, at least PATH_MAX), or NULL if the caller should leave the
+ * search to execvp.
+ */
+const char *path_cache_lookup(const char *file, char *resolved, size_t size)
+{
+    const char *path = getenv("PATH"), *opt = getenv("REATTACH_PATH_CACHE");
+    unsigned int ndirs;
+    uint64_t dirs_hash, walk_ns, checked, t0, now;
+    struct cache_file *c;
+
+    if (!opt || strchr(file, '/') || strlen(file) >= MAX_FILE || !(path && *path))
+        return NULL;
+    unsigned long trust = strtoul(opt, NULL, 10);
+
+    TRACE_BEGIN("path cache", file);
+    t0 = now_ns();
+    if (!(c = cache_map())) {
+        TRACE_END("path cache", NULL);
+        return NULL;
+    }
+
+    uint64_t key = fnv(fnv(FNV_INIT, path, strlen(path) + 1), file, strlen(file));
+    struct cache_entry *e = &c->entry[key % CACHE_ENTRIES];
+
+    if (!entry_read(e, key, file, resolved, &ndirs, &dirs_hash, &walk_ns, &checked)) {
+        now = time(NULL);
+        int fresh = trust && now >= checked && now - checked < trust;
+        if (fresh || hash_dirs(path, ndirs) == dirs_hash) {
+            if (!fresh)
+                __atomic_store_n(&e->checked, now, __ATOMIC_RELAXED);
+            uint64_t spent = now_ns() - t0;
+            uint64_t saved = walk_ns > spent ? walk_ns - spent : 0;
+            uint64_t hits = __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+            uint64_t total = __atomic_add_fetch(&c->saved_ns, saved, __ATOMIC_RELAXED);
+            debug("path cache hit: %s -> %s (%llu hits, %llu misses, %.1fus saved in all)",
+                    file, resolved, (unsigned long long)hits,
+                    (unsigned long long)c->misses, total / 1e3);
+            TRACE_END("path cache", "hit");
+            munmap(c, sizeof(*c));
+            return resolved;
+        }
+        __atomic_add_fetch(&c->stale, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+    t0 = now_ns();
+    if (walk(path, file, resolved, size, &ndirs) ||
+            strlen(resolved) >= MAX_RESOLVED) {
+        TRACE_END("path cache", "miss");
+        munmap(c, sizeof(*c));
+        return NULL;
+    }
+    walk_ns = now_ns() - t0;
+    dirs_hash = hash_dirs(path, ndirs);
+    entry_write(e, key, file, resolved, ndirs, dirs_hash, walk_ns);
+    debug("path cache miss: %s -> %s (%u directories, %.1fus)",
+            file, resolved, ndirs, walk_ns / 1e3);
+    TRACE_END("path cache", "miss");
+    munmap(c, sizeof(*c));
+    return resolved;
+}
@@ -0,0 +1,3 @@
+#include <stddef.h>
+
+const char *path_cache_lookup(const char *file, char *resolved, size_t size);
@@ -30,14 +30,22 @@
  */
 
 #include <string.h>    /* strlen, strcpy, strcmp, strrchr */
-#include <stdarg.h>    /* va_...   */
-#include <stdio.h>     /* fprintf, vfprintf  */
-#include <stdlib.h>    /* malloc, exit, free, atoi */
+#include <stdio.h>     /* printf   */
+#include <stdlib.h>    /* exit     */
 #include <unistd.h>    /* execvp   */
-#include <sys/utsname.h> /* uname  */
+#include <sys/errno.h> /* ETIMEDOUT */
 
 #include "msg.h"
-#include "move_to_user_namespace.h"
+#include "broker.h"
+#include "batch.h"
+#include "copy.h"
+#include "history.h"
+#include "paste.h"
+#include "trace.h"
+#include "reattach.h"
+#include "stats.h"
+
+extern char **environ;
 
 static const char version[] = "2.9";
 static const char supported_oses[] = "OS X 10.5-11.0";
@@ -50,10 +58,44 @@ void * _vprocmgr_move_subset_to_user(uid_t target_user, const char *session_type
 static const char usage_msg[] = "\n"
     "    Reattach to the per-user bootstrap namespace in its \"Background\"\n"
     "    session then exec the program with args. If \"-l\" is given,\n"
-    "    rewrite the program's argv[0] so that it starts with a '-'.\n";
+    "    rewrite the program's argv[0] so that it starts with a '-'.\n"
+    "\n"
+    "    With \"--broker\", reattach once and then serve launch requests\n"
+    "    from later (non-interactive) invocations over a per-user socket.\n"
+    "\n"
+    "    With \"-b\", reattach once and then run every command listed in\n"
+    "    file (or stdin), at most <jobs> at a time; see Usage.md.\n"
+    "\n"
+    "    With \"--copy\", reattach and put stdin on the pasteboard;\n"
+    "    with \"--paste\", reattach and write the pasteboard to stdout.\n"
+    "\n"
+    "    With \"--history\", list the copies kept by REATTACH_COPY_HISTORY\n"
+    "    (newest first), or write the Nth one to stdout.\n"
+    "\n"
+    "    With \"--stats\", print this user's launch counters (as JSON with\n"
+    "    \"--json\").\n";
+
+static int reattach(const char *argv0)
+{
+    if (reattach_init() != 0) {
+        if (errno == ETIMEDOUT) {
+            stats_reattach_timeout();
+            warn("%s: unable to reattach (timed out)", argv0);
+        } else {
+            stats_reattach_failed();
+            warn("%s: unable to reattach", argv0);
+        }
+        return -1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    unsigned int login = 0, usage = 0;
+    unsigned int login = 0, usage = 0, broker = 0, batch = 0, copy = 0, paste = 0;
+    unsigned int stats = 0, history = 0;
+
+    trace_init();
+    TRACE_BEGIN("main", NULL);
 
     if (argc > 1) {
         if (!strcmp(argv[1], "-l")) {
@@ -61,6 +103,18 @@ int main(int argc, char *argv[]) {
             argv[1] = argv[0];
             argv++;
             argc--;
+        } else if (!strcmp(argv[1], "--broker")) {
+            broker = 1;
+        } else if (!strcmp(argv[1], "-b")) {
+            batch = 1;
+        } else if (!strcmp(argv[1], "--copy")) {
+            copy = 1;
+        } else if (!strcmp(argv[1], "--paste")) {
+            paste = 1;
+        } else if (!strcmp(argv[1], "--stats")) {
+            stats = 1;
+        } else if (!strcmp(argv[1], "--history")) {
+            history = 1;
         } else if (!strcmp(argv[1], "-v") ||
                 !strcmp(argv[1], "--version")) {
             printf("%s version %s\n    Supported OSes: %s\n",
@@ -71,80 +125,46 @@ int main(int argc, char *argv[]) {
             usage = 2;
         }
     }
-    if (argc < 2)
+    if (broker || copy || paste ? argc != 2 : !batch && argc < 2)
+        usage = 1;
+    if (stats && !(argc == 2 || (argc == 3 && !strcmp(argv[2], "--json"))))
+        usage = 1;
+    if (history && !((argc == 3 && !strcmp(argv[2], "list")) ||
+                (argc == 4 && !strcmp(argv[2], "get"))))
         usage = 1;
     if (usage)
-        die(usage, "usage: %s [-l] <program> [args...]\n%s", argv[0], usage_msg);
-
-    unsigned int os = 0;
-
-    struct utsname u;
-    if (uname(&u)) {
-        warn_errno("uname failed");
-        goto reattach_failed;
-    }
-    if (strcmp(u.sysname, "Darwin")) {
-        warn("unsupported OS sysname: %s", u.sysname);
-        goto reattach_failed;
-    }
-
-    char *rest, *whole = strdup(u.release);
-    if (!whole) {
-        warn_errno("strdup failed");
-        goto reattach_failed;
+        die(usage, "usage: %s [-l] <program> [args...]\n"
+                "       %s --broker\n"
+                "       %s -b [-0] [-j <jobs>] [<file>]\n"
+                "       %s --copy | --paste\n"
+                "       %s --stats [--json]\n"
+                "       %s --history list | get <N>\n%s",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], usage_msg);
+
+    if (stats)
+        return stats_main(argc == 3);
+    if (history)
+        return history_main(argv[2], argc == 4 ? argv[3] : NULL);
+    stats_launch();
+
+    if (batch) {
+        struct batch *b = batch_load(argc - 2, argv + 2);
+        char *env[reattach_env_size(environ)];
+        if (!reattach(argv[0]))
+            environ = reattach_env(env, environ);
+        return batch_run(b);
     }
-    rest = whole;
-    strsep(&rest, ".");
-    if (whole && *whole && whole != rest) {
-        int major = atoi(whole);
-        os = 100000;    /* 10.1, 10.0 and prior betas/previews */
-        if (major >= 6) /* 10.2 and newer */
-            os += (major-4) * 100;
+    if (copy || paste) {
+        reattach(argv[0]);
+        return copy ? copy_main(0) : paste_main(1);
     }
-    else
-        warn("unparsable major release number: '%s'", u.release);
-
-    free(whole);
 
     /*
-     * change the 'os' variable to represent the "reattach variation"
-     * instead of the major OS release
-     *
-     *  older => 100500 with warning
-     *   10.5 => 100500
-     *   10.6 => 100600
-     *   10.7 => 100600
-     *   10.8 => 100600
-     *   10.9 => 100600
-     *   10.10=> 101000
-     *   10.11=> 101000
-     *   10.12=> 101000
-     *   10.13=> 101000
-     *   10.14=> 101000
-     *   10.15=> 101000
-     *  newer => 101000
+     * Nothing from here to the exec allocates: the new argv[0] lives
+     * on our stack and replaces file's slot in our own argv.
      */
-    if (100600 <= os && os <= 100900)
-        os = 100600;
-    else if (101000 <= os && os <= 101500)
-        os = 101000;
-    else if (os < 100500) {
-        warn("%s: unsupported old OS, trying as if it were 10.5", argv[0]);
-        os = 100500;
-    } else if (os > 101500) {
-        /*
-        warn("%s: unsupported new OS, trying as if it were 10.10", argv[0]);
-        */
-        os = 101000;
-    }
-
-    if (move_to_user_namespace(os) != 0) {
-reattach_failed:
-        warn("%s: unable to reattach", argv[0]);
-    }
-
-    char **newargs = NULL;
     const char *file = argv[1];
+    char arg0[login ? strlen(file) + 2 : 1];
     if (login) {
         /*
          * For their argv[0], take the bit of file after the
@@ -152,37 +172,31 @@ reattach_failed:
          * or if that bit would be zero length) and prefix
          * it with '-'.
          */
-        char *arg0 = malloc(strlen(file) + 2);
-        if (!arg0)
-            goto exec_it;
         *arg0 = '-';
-        char *slash = strrchr(file, '/');
+        const char *slash = strrchr(file, '/');
         if (slash && slash[1])
             strcpy(arg0+1, slash+1);
         else
             strcpy(arg0+1, file);
 
         /* use the rest of the args as they are */
-        newargs = malloc(sizeof(*newargs) * (argc));
-        if (!newargs) {
-            free(arg0);
-            goto exec_it;
-        }
-        newargs[0] = arg0;
-        int arg = 2;
-        for(; arg < argc; arg++)
-            newargs[arg-1] = argv[arg];
-        newargs[arg-1] = NULL;
+        argv[1] = arg0;
     }
+    char **args = argv+1;
 
-exec_it:
-    if (execvp(file, newargs ? newargs : argv+1) < 0)
-        die_errno(3, "%s: execv failed", argv[0]);
-
-    if (newargs) {
-        free(newargs[0]);
-        free(newargs);
+    /* an already reattached broker can launch it for us (does not return) */
+    if (!broker) {
+        TRACE_BEGIN("broker_spawn", NULL);
+        broker_spawn(file, args);
+        TRACE_END("broker_spawn", NULL);
     }
 
-    return 0;
+    reattach(argv[0]);
+
+    if (broker)
+        broker_serve();
+
+    TRACE_END("main", NULL);
+    reattach_execvp(file, args);
+    die_errno(3, "%s: execv failed", argv[0]);
 }
@@ -0,0 +1,59 @@
+#ifndef REATTACH_H
+#define REATTACH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * libreattach: what reattach-to-user-namespace does, for use inside a
+ * long-running host (e.g. a tmux server) so that it can move itself
+ * into the per-user namespace once and then start its children
+ * directly, instead of running each one through the wrapper.
+ *
+ * Every function may be called from any thread. The move happens (at
+ * most once per process) on the first call of any of them; other
+ * threads that call in meanwhile block until it is done. None of them
+ * changes environ or returns static storage.
+ */
+
+#if defined(__GNUC__)
+#define REATTACH_API __attribute__ ((visibility ("default")))
+#else
+#define REATTACH_API
+#endif
+
+/*
+ * Move this process into the per-user namespace, unless it (or, per
+ * an inherited REATTACH_NAMESPACE marker, an ancestor in its session)
+ * already has. Returns 0 on success, -1 (after warnings on stderr) if
+ * every backend failed, or -1 with errno ETIMEDOUT if REATTACH_TIMEOUT_MS
+ * passed first; later calls return the same answer.
+ */
+REATTACH_API int reattach_init(void);
+
+/*
+ * posix_spawnp argv[0] with argv and envp (NULL: our environment),
+ * marked as already reattached. fds, if not NULL, gives the child's
+ * stdin, stdout and stderr (-1: inherit ours); they must not
+ * themselves be 0, 1 or 2 except in their own slot. Returns the pid,
+ * or -1 with errno set.
+ */
+REATTACH_API pid_t reattach_spawn(char * const argv[], char * const envp[],
+        const int fds[3]);
+
+/*
+ * Exec argv[0] (or file) through PATH, as the wrapper does. Returns
+ * -1 with errno set if the exec failed.
+ */
+REATTACH_API int reattach_exec(char * const argv[]);
+REATTACH_API int reattach_execvp(const char *file, char * const argv[]);
+
+/*
+ * For hosts that start children their own way: env (room for
+ * reattach_env_size(from) entries) is filled with from, plus the
+ * marker if the move succeeded, and returned. Nothing is allocated.
+ */
+REATTACH_API size_t reattach_env_size(char * const from[]);
+REATTACH_API char **reattach_env(char *env[], char * const from[]);
+
+#endif
@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "msg.h"
+#include "sanitize.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define HAVE_X86_VECTORS 1
+#include <immintrin.h>
+#endif
+
+/*
+ * The optional --paste sanitizer: keeps pasted text from driving the
+ * terminal it lands in. Tab, newline and carriage return pass; every
+ * other C0 control, DEL and every C1 control (as UTF-8, U+0080 to
+ * U+009F) is either dropped along with the whole escape sequence it
+ * starts (so a forged "ESC [ 201 ~" ends no bracketed paste, and an
+ * OSC 52 sets no clipboard), or shown the way "cat -v" shows it.
+ * Raw 8-bit C1 bytes are left alone: in UTF-8 they are not controls.
+ * A 0xc2 that does not start a character is dropped too, so that it
+ * can not pair up with a byte after a dropped sequence into a C1.
+ *
+ * As in normalize.c, the input is scanned a vector at a time (AVX2,
+ * SSE2, or a 64-bit word) for the only bytes that matter, the controls
+ * and 0xc2 (which leads every C1 control), and the runs between them
+ * are passed on untouched. The bytes of a sequence being dropped are
+ * skipped the same way until something that could end it turns up.
+ */
+
+#define OUT_SIZE (64 * 1024)
+#define DIRECT_MIN 4096     /* runs this long are emitted from the input */
+
+#define BEL 0x07
+#define CAN 0x18
+#define SUB 0x1a
+#define ESC 0x1b
+#define DEL 0x7f
+#define C1_LEAD 0xc2
+
+enum {
+    GROUND,     /* text */
+    GROUND_C2,  /* text, just after 0xc2 */
+    IN_ESC,     /* after ESC */
+    IN_INTER,   /* ESC, intermediates */
+    IN_CSI,     /* ESC [ (or CSI), parameters and intermediates */
+    IN_STR,     /* OSC, DCS, SOS, PM or APC string, until ST or BEL */
+    IN_STR_ESC, /* ... just after an ESC, which may start ST */
+    IN_STR_C2,  /* ... just after 0xc2, which may start ST */
+};
+
+static int special(unsigned char c)
+{
+    return (c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == DEL ||
+        c == C1_LEAD;
+}
+
+static size_t scan_word(const unsigned char *p, size_t len)
+{
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w, x, y;
+        memcpy(&w, p + i, sizeof(w));
+        x = w ^ (ones * DEL);
+        y = w ^ (ones * C1_LEAD);
+        /* any byte below 0x20 (even a newline) sends the word to the exact check */
+        if (((w - ones * 0x20) & ~w & highs) | ((x - ones) & ~x & highs) |
+                ((y - ones) & ~y & highs)) {
+            size_t j;
+            for (j = i; j < i + 8; j++)
+                if (special(p[j]))
+                    return j;
+        }
+    }
+    for (; i < len; i++)
+        if (special(p[i]))
+            break;
+    return i;
+}
+
+#ifdef HAVE_X86_VECTORS
+static size_t scan_sse2(const unsigned char *p, size_t len)
+{
+    const __m128i c0 = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(DEL);
+    const __m128i lead = _mm_set1_epi8((char)C1_LEAD), tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, c0), v);
+        __m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                    _mm_cmpeq_epi8(v, nl)), _mm_cmpeq_epi8(v, cr));
+        unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_andnot_si128(ok, ctl), _mm_or_si128(
+                        _mm_cmpeq_epi8(v, del), _mm_cmpeq_epi8(v, lead))));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + scan_word(p + i, len - i);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t scan_avx2(const unsigned char *p, size_t len)
+{
+    const __m256i c0 = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(DEL);
+    const __m256i lead = _mm256_set1_epi8((char)C1_LEAD), tab = _mm256_set1_epi8('\t');
+    const __m256i nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, c0), v);
+        __m256i ok = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                    _mm256_cmpeq_epi8(v, nl)), _mm256_cmpeq_epi8(v, cr));
+        unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_andnot_si256(ok, ctl), _mm256_or_si256(
+                        _mm256_cmpeq_epi8(v, del), _mm256_cmpeq_epi8(v, lead))));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + scan_sse2(p + i, len - i);
+}
+#endif
+
+typedef size_t scan_func(const unsigned char *p, size_t len);
+
+static const struct {
+    const char *name;
+    scan_func *scan;
+} kernels[] = {
+#ifdef HAVE_X86_VECTORS
+    { "avx2", scan_avx2 },
+    { "sse2", scan_sse2 },
+#endif
+    { "word", scan_word },
+};
+
+static unsigned int kernel;
+static scan_func *scan;
+
+/* the fastest the CPU has, unless REATTACH_SANITIZE_KERNEL names another */
+static scan_func *pick_scan(void)
+{
+    const char *want = getenv("REATTACH_SANITIZE_KERNEL");
+    unsigned int i;
+
+    for (i = 0; want && i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if (!strcmp(want, kernels[i].name))
+            return kernels[kernel = i].scan;
+#ifdef HAVE_X86_VECTORS
+    __builtin_cpu_init();
+    kernel = __builtin_cpu_supports("avx2") ? 0 : 1;
+#endif
+    return kernels[kernel].scan;
+}
+
+static int flush(struct sanitize *s)
+{
+    if (s->len && s->emit(s->ctx, s->out, s->len))
+        return -1;
+    s->len = 0;
+    return 0;
+}
+
+static int put(struct sanitize *s, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len) {
+        size_t space = s->alloc - s->len;
+        if (!space) {
+            if (flush(s))
+                return -1;
+            continue;
+        }
+        if (space > len)
+            space = len;
+        memcpy(s->out + s->len, p, space);
+        s->len += space;
+        p += space;
+        len -= space;
+    }
+    return 0;
+}
+
+/* a run of plain text: long ones skip the buffer */
+static int put_run(struct sanitize *s, const unsigned char *p, size_t len)
+{
+    if (len >= DIRECT_MIN)
+        return flush(s) || s->emit(s->ctx, (const char *)p, len) ? -1 : 0;
+    return put(s, p, len);
+}
+
+/* a C0 control or DEL in text */
+static int control(struct sanitize *s, unsigned char c)
+{
+    if (s->mode == SANITIZE_ESCAPE) {
+        char e[2] = { '^', (char)(c ^ 0x40) };
+        s->controls++;
+        return put(s, e, 2);
+    }
+    if (c == ESC)
+        s->state = IN_ESC;
+    else
+        s->controls++;
+    return 0;
+}
+
+/* a C1 control (0x80 to 0x9f, from the two bytes 0xc2 c) in text */
+static int c1(struct sanitize *s, unsigned char c)
+{
+    if (s->mode == SANITIZE_ESCAPE) {
+        char e[4] = { 'M', '-', '^', (char)((c - 0x80) ^ 0x40) };
+        s->controls++;
+        return put(s, e, 4);
+    }
+    switch (c) {
+    case 0x9b:                  /* CSI */
+        s->state = IN_CSI;
+        break;
+    case 0x90: case 0x98: case 0x9d: case 0x9e: case 0x9f:  /* DCS SOS OSC PM APC */
+        s->state = IN_STR;
+        break;
+    default:
+        s->controls++;
+    }
+    return 0;
+}
+
+static void done(struct sanitize *s)
+{
+    s->sequences++;
+    s->state = GROUND;
+}
+
+/*
+ * A byte that can not go on with the sequence: ESC starts another,
+ * other controls are dropped (a terminal would act on them), and
+ * anything else abandons it and is handed back (0) to be text.
+ */
+static int other(struct sanitize *s, unsigned char c)
+{
+    if (c == ESC) {
+        s->sequences++;
+        s->state = IN_ESC;
+        return 1;
+    }
+    if (c < 0x20 || c == DEL) {
+        s->controls++;
+        return 1;
+    }
+    done(s);
+    return 0;
+}
+
+/* the next byte of a sequence being dropped; 0 if it is not part of it */
+static int sequence(struct sanitize *s, unsigned char c)
+{
+    if (c == CAN || c == SUB) {
+        done(s);
+        return 1;
+    }
+    switch (s->state) {
+    case IN_STR_ESC:
+        if (c == '\\') {
+            done(s);
+            return 1;
+        }
+        /* no ST: the string is over, and a new sequence starts */
+        s->sequences++;
+        s->state = IN_ESC;
+        /* fall through */
+    case IN_ESC:
+        if (c == '[')
+            s->state = IN_CSI;
+        else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+            s->state = IN_STR;
+        else if (c >= 0x20 && c <= 0x2f)
+            s->state = IN_INTER;
+        else if (c >= 0x30 && c <= 0x7e)
+            done(s);
+        else
+            return other(s, c);
+        return 1;
+    case IN_INTER:
+        if (c >= 0x20 && c <= 0x2f)
+            return 1;
+        if (c >= 0x30 && c <= 0x7e) {
+            done(s);
+            return 1;
+        }
+        return other(s, c);
+    case IN_CSI:
+        if (c >= 0x20 && c <= 0x3f)
+            return 1;
+        if (c >= 0x40 && c <= 0x7e) {
+            done(s);
+            return 1;
+        }
+        return other(s, c);
+    case IN_STR_C2:
+        if (c == 0x9c) {
+            done(s);
+            return 1;
+        }
+        s->state = IN_STR;
+        /* fall through */
+    default:
+        if (c == BEL)
+            done(s);
+        else if (c == ESC)
+            s->state = IN_STR_ESC;
+        else if (c == C1_LEAD)
+            s->state = IN_STR_C2;
+        return 1;
+    }
+}
+
+/* "" or "strip": SANITIZE_STRIP; "escape": SANITIZE_ESCAPE */
+int sanitize_mode(const char *spec, int *mode)
+{
+    if (!*spec || !strcmp(spec, "strip"))
+        *mode = SANITIZE_STRIP;
+    else if (!strcmp(spec, "escape"))
+        *mode = SANITIZE_ESCAPE;
+    else
+        return -1;
+    return 0;
+}
+
+int sanitize_init(struct sanitize *s, int mode, sanitize_emit *emit, void *ctx)
+{
+    memset(s, 0, sizeof(*s));
+    s->mode = mode;
+    s->emit = emit;
+    s->ctx = ctx;
+    s->alloc = OUT_SIZE;
+    if (!(s->out = malloc(s->alloc))) {
+        warn("out of memory");
+        return -1;
+    }
+    if (!scan)
+        scan = pick_scan();
+    return 0;
+}
+
+int sanitize_update(struct sanitize *s, const char *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data, *end = p + len;
+    size_t run;
+
+    while (p < end) {
+        switch (s->state) {
+        case GROUND:
+            run = scan(p, end - p);
+            if (run && put_run(s, p, run))
+                return -1;
+            p += run;
+            if (p == end)
+                break;
+            if (*p == C1_LEAD)
+                s->state = GROUND_C2;
+            else if (control(s, *p))
+                return -1;
+            p++;
+            break;
+        case GROUND_C2:
+            s->state = GROUND;
+            if (*p >= 0x80 && *p <= 0x9f) {
+                if (c1(s, *p))
+                    return -1;
+                p++;
+            } else if (*p >= 0xa0 && *p <= 0xbf) {
+                if (put(s, "\xc2", 1))
+                    return -1;
+            } else
+                s->controls++;
+            break;
+        case IN_STR:
+            /* nothing but a control or 0xc2 can end a string */
+            p += scan(p, end - p);
+            if (p == end)
+                break;
+            /* fall through */
+        default:
+            if (sequence(s, *p))
+                p++;
+        }
+    }
+    return 0;
+}
+
+/* the input is complete: an unfinished sequence is dropped */
+int sanitize_final(struct sanitize *s)
+{
+    if (s->state == GROUND_C2)
+        s->controls++;
+    else if (s->state != GROUND)
+        s->sequences++;
+    s->state = GROUND;
+    return flush(s);
+}
+
+void sanitize_free(struct sanitize *s)
+{
+    free(s->out);
+    s->out = NULL;
+}
+
+const char *sanitize_kernel(void)
+{
+    if (!scan)
+        scan = pick_scan();
+    return kernels[kernel].name;
+}
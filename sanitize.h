@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* what --paste does to control characters; see sanitize.c */
+#define SANITIZE_STRIP  1   /* drop them, and whole escape sequences */
+#define SANITIZE_ESCAPE 2   /* show them as ^[, ^A, M-^[ ... */
+
+/* receives the sanitized text in pieces; nonzero stops with an error */
+typedef int sanitize_emit(void *ctx, const char *data, size_t len);
+
+struct sanitize {
+    int mode;
+    sanitize_emit *emit;
+    void *ctx;
+    char *out;                  /* sanitized, not yet emitted */
+    size_t len, alloc;
+    int state;                  /* where the last chunk left off */
+    uint64_t controls, sequences;   /* removed or escaped */
+};
+
+int sanitize_mode(const char *spec, int *mode);
+int sanitize_init(struct sanitize *s, int mode, sanitize_emit *emit, void *ctx);
+int sanitize_update(struct sanitize *s, const char *data, size_t len);
+int sanitize_final(struct sanitize *s);
+void sanitize_free(struct sanitize *s);
+const char *sanitize_kernel(void);
@@ -0,0 +1,223 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "msg.h"
+#include "stats.h"
+#include "timing.h"
+#include "user_path.h"
+
+/*
+ * "stats" in the per-user directory is an mmap'd table of counters
+ * that every run of the wrapper adds to: launches, reattach and exec
+ * failures, reattach timeouts, each backend's successful and failed moves, and a
+ * histogram of the time from start to exec. All updates are relaxed
+ * atomic adds, so concurrent runs need no lock and a reader may see
+ * a launch whose latency is not in yet. "--stats" prints the table.
+ *
+ * The file is mapped by the first update of a run; if that fails (no
+ * per-user directory, say), the run simply is not counted.
+ *
+ * New counters only ever go at the end of the table. A file from an
+ * earlier version (a shorter table, recorded in size) is grown in
+ * place: the new counters start at zero and the old ones are kept.
+ */
+
+#define STATS_MAGIC 0x72747374 /* "rtst" */
+#define STATS_BACKENDS 8
+#define STATS_BUCKETS 32    /* bucket i > 0: [2^(i-1), 2^i) microseconds */
+
+struct stats_backend {
+    char name[16];
+    uint64_t ok, failed;
+};
+
+struct stats_file {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t launches;
+    uint64_t reattach_failures;
+    uint64_t exec_failures;
+    struct stats_backend backend[STATS_BACKENDS];
+    uint64_t latency_count, latency_sum_ns;
+    uint64_t latency[STATS_BUCKETS];
+    uint64_t reattach_timeouts;
+};
+
+/* the table as the first version wrote it */
+#define STATS_V1_SIZE offsetof(struct stats_file, reattach_timeouts)
+
+static struct stats_file *stats;
+static uint64_t launched;
+
+static struct stats_file *stats_map(void)
+{
+    char path[PATH_MAX];
+    struct stats_file *s;
+    struct stat st;
+    int fd;
+
+    if (user_path(path, sizeof(path), "stats"))
+        return NULL;
+    if ((fd = open(path, O_RDWR|O_CREAT, 0600)) < 0)
+        return NULL;
+    if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(*s) &&
+                ftruncate(fd, sizeof(*s)))) {
+        close(fd);
+        return NULL;
+    }
+    s = mmap(NULL, sizeof(*s), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+        return NULL;
+
+    /* an earlier table: what it lacks was zero filled by the ftruncate */
+    if (s->magic == STATS_MAGIC && s->size >= STATS_V1_SIZE && s->size < sizeof(*s)) {
+        uint32_t size = s->size;
+        __atomic_compare_exchange_n(&s->size, &size, sizeof(*s), 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    /* a new (zero filled) or foreign file: claim it */
+    if (s->magic != STATS_MAGIC || s->size != sizeof(*s)) {
+        memset(s, 0, sizeof(*s));
+        s->size = sizeof(*s);
+        __atomic_store_n(&s->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    }
+    return s;
+}
+
+#define ADD(FIELD, N) __atomic_add_fetch(&(FIELD), (N), __ATOMIC_RELAXED)
+
+/* count this run and start its latency clock */
+void stats_launch(void)
+{
+    launched = now_ns();
+    if ((stats = stats_map()))
+        ADD(stats->launches, 1);
+}
+
+void stats_backend(unsigned int idx, const char *name, int ok)
+{
+    struct stats_backend *b;
+
+    if (!stats || idx >= STATS_BACKENDS)
+        return;
+    b = &stats->backend[idx];
+    if (strncmp(b->name, name, sizeof(b->name)))
+        strncpy(b->name, name, sizeof(b->name) - 1);
+    if (ok)
+        ADD(b->ok, 1);
+    else
+        ADD(b->failed, 1);
+}
+
+void stats_reattach_failed(void)
+{
+    if (stats)
+        ADD(stats->reattach_failures, 1);
+}
+
+void stats_reattach_timeout(void)
+{
+    if (stats)
+        ADD(stats->reattach_timeouts, 1);
+}
+
+static unsigned int bucket(uint64_t us)
+{
+    unsigned int i = 0;
+    while (us && i < STATS_BUCKETS - 1) {
+        us >>= 1;
+        i++;
+    }
+    return i;
+}
+
+/* the run is about to exec: record how long it took to get here */
+void stats_exec(void)
+{
+    uint64_t ns;
+
+    if (!stats)
+        return;
+    ns = now_ns() - launched;
+    ADD(stats->latency[bucket(ns / 1000)], 1);
+    ADD(stats->latency_sum_ns, ns);
+    ADD(stats->latency_count, 1);
+}
+
+void stats_exec_failed(void)
+{
+    if (stats)
+        ADD(stats->exec_failures, 1);
+}
+
+#define GET(FIELD) ((unsigned long long)__atomic_load_n(&(FIELD), __ATOMIC_RELAXED))
+
+static void show_text(const struct stats_file *s)
+{
+    unsigned int i;
+
+    printf("launches: %llu\n", GET(s->launches));
+    printf("reattach failures: %llu\n", GET(s->reattach_failures));
+    printf("reattach timeouts: %llu\n", GET(s->reattach_timeouts));
+    printf("exec failures: %llu\n", GET(s->exec_failures));
+    for (i = 0; i < STATS_BACKENDS; i++)
+        if (s->backend[i].name[0])
+            printf("backend %s: %llu ok, %llu failed\n", s->backend[i].name,
+                    GET(s->backend[i].ok), GET(s->backend[i].failed));
+
+    unsigned long long n = GET(s->latency_count);
+    printf("time to exec: %llu launches, mean %.1fus\n", n,
+            n ? GET(s->latency_sum_ns) / 1e3 / n : 0.0);
+    for (i = 0; i < STATS_BUCKETS; i++)
+        if (GET(s->latency[i]))
+            printf("  %10lluus - %10lluus: %llu\n",
+                    i ? 1ULL << (i - 1) : 0ULL, 1ULL << i, GET(s->latency[i]));
+}
+
+static void show_json(const struct stats_file *s)
+{
+    unsigned int i;
+    int sep = 0;
+
+    printf("{\"launches\": %llu, \"reattach_failures\": %llu, \"reattach_timeouts\": %llu,\n"
+            " \"exec_failures\": %llu,\n",
+            GET(s->launches), GET(s->reattach_failures), GET(s->reattach_timeouts),
+            GET(s->exec_failures));
+    printf(" \"backends\": {");
+    for (i = 0; i < STATS_BACKENDS; i++)
+        if (s->backend[i].name[0])
+            printf("%s\"%s\": {\"ok\": %llu, \"failed\": %llu}", sep++ ? ", " : "",
+                    s->backend[i].name, GET(s->backend[i].ok),
+                    GET(s->backend[i].failed));
+    printf("},\n \"time_to_exec\": {\"count\": %llu, \"sum_ns\": %llu, \"buckets_us\": [",
+            GET(s->latency_count), GET(s->latency_sum_ns));
+    for (i = 0, sep = 0; i < STATS_BUCKETS; i++)
+        if (GET(s->latency[i]))
+            printf("%s{\"lt\": %llu, \"count\": %llu}", sep++ ? ", " : "",
+                    1ULL << i, GET(s->latency[i]));
+    printf("]}}\n");
+}
+
+/* --stats: print the counters (as JSON with json set) */
+int stats_main(int json)
+{
+    const struct stats_file *s = stats ? stats : stats_map();
+
+    if (!s) {
+        warn("unable to open the stats file");
+        return 1;
+    }
+    if (json)
+        show_json(s);
+    else
+        show_text(s);
+    return fflush(stdout) ? 1 : 0;
+}
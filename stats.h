@@ -0,0 +1,11 @@
+/*
+ * Per-user usage counters, shared by every run of the wrapper; see
+ * stats.c. Each update is a handful of atomic adds on an mmap'd file.
+ */
+void stats_launch(void);
+void stats_backend(unsigned int idx, const char *name, int ok);
+void stats_reattach_failed(void);
+void stats_reattach_timeout(void);
+void stats_exec(void);
+void stats_exec_failed(void);
+int stats_main(int json);
@@ -34,10 +34,19 @@
 #include <sys/errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/wait.h>
 #include <dlfcn.h>
+#include <stdint.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <limits.h>
 
 #include "msg.h"
 #include "move_to_user_namespace.h"
+#include "timing.h"
+#include "hist.h"
 
 #define UNUSED __attribute__ ((unused))
 
@@ -71,18 +80,49 @@ static void do_daemon(const char *opt) {
     if (!(opt && *opt))
         die(2, "daemon requires an option (i.e. daemon=sys)");
 
+    /* optional ":<nochdir><noclose>", e.g. "sys:00"; default 1 and 0 */
+    int nochdir = 1, noclose = 0;
+    size_t len = strcspn(opt, ":");
+    if (opt[len]) {
+        const char *f = opt + len + 1;
+        if (strlen(f) != 2 || strspn(f, "01") != 2)
+            die(2, "daemon: bad flags: %s", f);
+        nochdir = f[0] == '1';
+        noclose = f[1] == '1';
+    }
+
     int (*daemon_)(int,int);
-    if (!strcmp(opt,"sys"))
+    if (!strncmp(opt, "sys", len) && len == 3)
         daemon_ = sys_daemon;
-    else if (!strcmp(opt, "ours"))
+    else if (!strncmp(opt, "ours", len) && len == 4)
         daemon_ = our_daemon;
     else
         die(2, "daemon: unknown option: %s", opt);
 
-    int r = daemon_(1,0);
+    int r = daemon_(nochdir, noclose);
     if (r) die_errno(2, "%s daemon() failed = %d", opt, r);
 }
 
+static pid_t start_pid;
+
+/* what daemon(3) is supposed to have changed, without pids (so runs compare) */
+static void daemon_state(const char *opt UNUSED) {
+    struct stat null, st;
+    char cwd[PATH_MAX];
+    int fd;
+
+    msg("pid changed: %s", getpid() != start_pid ? "yes" : "no");
+    msg("session leader: %s", getsid(0) == getpid() ? "yes" : "no");
+    msg("process group leader: %s", getpgrp() == getpid() ? "yes" : "no");
+    msg("cwd: %s", getcwd(cwd, sizeof(cwd)) ? cwd : "?");
+    if (stat("/dev/null", &null))
+        die_errno(2, "stat /dev/null");
+    for (fd = 0; fd < 3; fd++)
+        msg("fd %d: %s", fd, fstat(fd, &st) ? "closed" :
+                st.st_rdev == null.st_rdev && st.st_ino == null.st_ino ?
+                "/dev/null" : "other");
+}
+
 static void show_pid(const char *opt) {
     msg("pid: %d (%s)", getpid(), opt ? opt : "");
 }
@@ -131,6 +171,188 @@ static void do_system(const char *opt) {
         msg("system(%s) process stopped with signal %d", opt, WSTOPSIG(r));
 }
 
+/*
+ * Split opt into words: blanks separate them, '...' and "..." quote
+ * (without escapes) and a backslash outside quotes takes the next
+ * character literally. The words share one malloc'ed buffer.
+ */
+static char **split_words(const char *opt) {
+    size_t len = strlen(opt);
+    char *buf = malloc(len + 1);
+    char **words = malloc((len / 2 + 2) * sizeof(*words));
+    if (!buf || !words)
+        die(7, "out of memory");
+
+    int n = 0, in_word = 0;
+    char quote = 0, *out = buf;
+    for (; *opt; opt++) {
+        char c = *opt;
+        if (quote) {
+            if (c == quote)
+                quote = 0;
+            else
+                *out++ = c;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n') {
+            if (in_word) {
+                *out++ = '\0';
+                in_word = 0;
+            }
+            continue;
+        }
+        if (!in_word) {
+            words[n++] = out;
+            in_word = 1;
+        }
+        if (c == '\'' || c == '"')
+            quote = c;
+        else if (c == '\\' && opt[1])
+            *out++ = *++opt;
+        else
+            *out++ = c;
+    }
+    if (quote)
+        die(7, "spawn: unterminated %c quote", quote);
+    *out = '\0';
+    words[n] = NULL;
+    return words;
+}
+
+struct capture {
+    char *buf;
+    size_t len, alloc;
+};
+
+static int capture_read(int fd, struct capture *c) {
+    if (c->alloc - c->len < 4096) {
+        c->alloc = c->alloc ? c->alloc * 2 : 16384;
+        if (!(c->buf = realloc(c->buf, c->alloc)))
+            die(7, "out of memory");
+    }
+    ssize_t r = read(fd, c->buf + c->len, c->alloc - c->len);
+    if (r < 0 && (errno == EINTR || errno == EAGAIN))
+        return 1;
+    if (r > 0)
+        c->len += r;
+    return r > 0;
+}
+
+static const char *expect_file;
+static void set_expect(const char *opt) {
+    expect_file = opt && *opt ? opt : NULL;
+}
+
+/* 0 if got matches the contents of path */
+static int compare_expected(const char *path, const struct capture *got) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die_errno(7, "unable to open expected output %s", path);
+    char buf[65536];
+    size_t off = 0;
+    ssize_t r;
+    int differ = 0;
+    while (!differ && (r = read(fd, buf, sizeof(buf))) > 0) {
+        if (off + r > got->len || memcmp(got->buf + off, buf, r))
+            differ = 1;
+        off += r;
+    }
+    if (r < 0)
+        die_errno(7, "unable to read expected output %s", path);
+    close(fd);
+    return differ || off != got->len;
+}
+
+static void do_spawn(const char *opt) {
+    extern char **environ;
+    if (!(opt && *opt))
+        die(7, "spawn requires a command (i.e. spawn=pbpaste)");
+    char **words = split_words(opt);
+    if (!words[0])
+        die(7, "spawn requires a command (i.e. spawn=pbpaste)");
+
+    int outp[2], errp[2];
+    if (pipe(outp) || pipe(errp))
+        die_errno(7, "spawn: pipe failed");
+
+    posix_spawn_file_actions_t fa;
+    if (posix_spawn_file_actions_init(&fa) ||
+            posix_spawn_file_actions_adddup2(&fa, outp[1], 1) ||
+            posix_spawn_file_actions_adddup2(&fa, errp[1], 2) ||
+            posix_spawn_file_actions_addclose(&fa, outp[0]) ||
+            posix_spawn_file_actions_addclose(&fa, errp[0]) ||
+            posix_spawn_file_actions_addclose(&fa, out_fd))
+        die(7, "spawn: unable to set up file actions");
+
+    pid_t pid;
+    uint64_t t0 = now_ns(), first = 0;
+    int err = posix_spawnp(&pid, words[0], &fa, NULL, words, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(outp[1]);
+    close(errp[1]);
+    if (err) {
+        errno = err;
+        die_errno(7, "spawn of %s failed", words[0]);
+    }
+
+    struct capture cap[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+    struct pollfd pfd[2] = { { outp[0], POLLIN, 0 }, { errp[0], POLLIN, 0 } };
+    int open_fds = 2, i;
+    while (open_fds) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die_errno(7, "spawn: poll failed");
+        }
+        for (i = 0; i < 2; i++) {
+            if (pfd[i].fd < 0 || !pfd[i].revents)
+                continue;
+            size_t before = cap[i].len;
+            if (!capture_read(pfd[i].fd, &cap[i])) {
+                close(pfd[i].fd);
+                pfd[i].fd = -1;
+                open_fds--;
+            }
+            if (!first && cap[i].len > before)
+                first = now_ns();
+        }
+    }
+
+    int st;
+    struct rusage ru;
+    while (wait4(pid, &st, 0, &ru) < 0)
+        if (errno != EINTR)
+            die_errno(7, "spawn: wait4 failed");
+    uint64_t t1 = now_ns();
+
+    if (expect_file)
+        msg("spawn(%s) output %s %s", opt,
+                compare_expected(expect_file, &cap[0]) ? "differs from" : "matches",
+                expect_file);
+    else if (cap[0].len && write(out_fd, cap[0].buf, cap[0].len) < 0)
+        die_errno(7, "write of captured output failed");
+    if (cap[1].len && write(out_fd, cap[1].buf, cap[1].len) < 0)
+        die_errno(7, "write of captured output failed");
+
+    if (WIFEXITED(st))
+        msg("spawn(%s) process exited %d", opt, WEXITSTATUS(st));
+    else if (WIFSIGNALED(st))
+        msg("spawn(%s) process terminated by signal %d", opt, WTERMSIG(st));
+    msg("    total %.1fus, first byte %s%.1fus, user %.1fms, sys %.1fms, "
+            "maxrss %ld, out %lu bytes, err %lu bytes",
+            (t1 - t0) / 1e3, first ? "" : "(none) ",
+            first ? (first - t0) / 1e3 : 0.0,
+            ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3,
+            ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3,
+            (long)ru.ru_maxrss,
+            (unsigned long)cap[0].len, (unsigned long)cap[1].len);
+
+    free(cap[0].buf);
+    free(cap[1].buf);
+    free(words[0]);  /* the buffer all the words are in */
+    free(words);
+}
+
 static int parse_int(const char *str, char **rest_,
         char expected_stop) {
     char *rest;
@@ -180,6 +402,219 @@ static void show_msg(const char *opt) {
     msg("%s", opt);
 }
 
+static void run_seq(const char * const *toks, int n);
+
+/*
+ * Split a script into words (runs of non-blank characters; '#' starts
+ * a comment that runs to the end of the line) and run them as if they
+ * had been given as arguments.
+ */
+static void do_script(const char *opt) {
+    if (!(opt && *opt))
+        die(1, "script requires a file name");
+    FILE *f = fopen(opt, "r");
+    if (!f) die_errno(1, "unable to open script %s", opt);
+
+    size_t alloc = 0, n = 0, len = 0;
+    char **toks = NULL, *line = NULL;
+    while (getline(&line, &len, f) >= 0) {
+        char *hash = strchr(line, '#'), *w, *save;
+        if (hash) *hash = '\0';
+        for (w = strtok_r(line, " \t\r\n", &save); w;
+                w = strtok_r(NULL, " \t\r\n", &save)) {
+            if (n == alloc) {
+                alloc = alloc ? alloc * 2 : 64;
+                if (!(toks = realloc(toks, alloc * sizeof(*toks))))
+                    die(1, "out of memory");
+            }
+            if (!(toks[n++] = strdup(w)))
+                die(1, "out of memory");
+        }
+    }
+    if (ferror(f)) die_errno(1, "error reading script %s", opt);
+    fclose(f);
+    free(line);
+
+    run_seq((const char * const *)toks, n);
+}
+
+/*
+ * Timing: each time{...} block (by position in the command list) gets a
+ * histogram, printed when the driver exits.
+ */
+struct timer {
+    const char * const *where;
+    char label[64];
+    struct hist h;
+    struct timer *next;
+};
+static struct timer *timers;
+static int in_worker;       /* parallel workers leave reporting to the parent */
+static unsigned long cmds_run;
+
+static void show_timers(void) {
+    struct timer *t;
+    if (in_worker)
+        return;
+    for (t = timers; t; t = t->next)
+        msg("%-32s n=%-7llu p50=%9.1fus p90=%9.1fus p99=%9.1fus max=%9.1fus",
+                t->label, (unsigned long long)t->h.count,
+                hist_percentile(&t->h, 50) / 1e3,
+                hist_percentile(&t->h, 90) / 1e3,
+                hist_percentile(&t->h, 99) / 1e3,
+                t->h.max / 1e3);
+}
+
+static struct timer *timer_for(const char * const *where,
+        const char *opt, const char * const *body, int n) {
+    struct timer *t, **tail = &timers;
+    for (t = timers; t; t = t->next) {
+        if (t->where == where)
+            return t;
+        tail = &t->next;
+    }
+    if (!(t = calloc(1, sizeof(*t))))
+        die(1, "out of memory");
+    t->where = where;
+    if (opt && *opt)
+        snprintf(t->label, sizeof(t->label), "%s", opt);
+    else {
+        /* label it with its commands */
+        size_t used = 0;
+        int i;
+        for (i = 0; i < n && used < sizeof(t->label); i++)
+            used += snprintf(t->label + used, sizeof(t->label) - used,
+                    "%s%s", i ? " " : "", body[i]);
+    }
+    if (!timers)
+        atexit(show_timers);
+    *tail = t;
+    return t;
+}
+
+static void block_repeat(const char *opt, const char * const *body, int n) {
+    char *rest;
+    if (!(opt && *opt))
+        die(1, "repeat requires a count (i.e. repeat=10{ ... })");
+    errno = 0;
+    long count = strtol(opt, &rest, 0);
+    if (errno || *rest || count < 0)
+        die(1, "repeat: bad count: %s", opt);
+    while (count-- > 0)
+        run_seq(body, n);
+}
+
+static void block_time(const char *opt, const char * const *body, int n) {
+    struct timer *t = timer_for(body, opt, body, n);
+    uint64_t t0 = now_ns();
+    run_seq(body, n);
+    hist_record(&t->h, now_ns() - t0);
+}
+
+/*
+ * Fork n workers that all wait on one pipe; closing its write end
+ * starts them together. Each sends back how long its run of the block
+ * took and how many commands it ran; a worker that does not (or exits
+ * non-zero) counted as failed.
+ */
+struct worker_result {
+    uint32_t idx;
+    uint32_t cmds;
+    uint64_t ns;
+};
+
+static void block_parallel(const char *opt, const char * const *body, int n) {
+    char *rest;
+    if (!(opt && *opt))
+        die(1, "parallel requires a worker count (i.e. parallel=8{ ... })");
+    errno = 0;
+    long workers = strtol(opt, &rest, 0);
+    if (errno || *rest || workers < 1 || workers > 4096)
+        die(1, "parallel: bad worker count: %s", opt);
+
+    int start[2], results[2];
+    if (pipe(start) || pipe(results))
+        die_errno(1, "parallel: pipe failed");
+    pid_t *pids = calloc(workers, sizeof(*pids));
+    struct worker_result *res = calloc(workers, sizeof(*res));
+    char *reported = calloc(workers, 1);
+    if (!pids || !res || !reported)
+        die(1, "out of memory");
+
+    long i;
+    for (i = 0; i < workers; i++) {
+        if ((pids[i] = fork()) < 0)
+            die_errno(1, "parallel: fork failed");
+        if (pids[i])
+            continue;
+
+        char c;
+        in_worker = 1;
+        close(start[1]);
+        close(results[0]);
+        if (read(start[0], &c, 1) < 0)
+            _exit(1);
+        cmds_run = 0;
+        uint64_t t0 = now_ns();
+        run_seq(body, n);
+        struct worker_result r = { i, cmds_run, now_ns() - t0 };
+        if (write(results[1], &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+        exit(0);
+    }
+    close(start[0]);
+    close(results[1]);
+
+    uint64_t t0 = now_ns();
+    close(start[1]);            /* go */
+    struct worker_result r;
+    while (read(results[0], &r, sizeof(r)) == sizeof(r))
+        if (r.idx < workers) {
+            res[r.idx] = r;
+            reported[r.idx] = 1;
+        }
+    uint64_t wall = now_ns() - t0;
+    close(results[0]);
+
+    char label[64];
+    snprintf(label, sizeof(label), "parallel=%ld (per worker)", workers);
+    struct timer *t = timer_for(body - 1, label, body - 1, 1);
+    unsigned long failed = 0, cmds = 0;
+    for (i = 0; i < workers; i++) {
+        int st;
+        if (waitpid(pids[i], &st, 0) < 0)
+            die_errno(1, "parallel: waitpid failed");
+        if (!reported[i] || !WIFEXITED(st) || WEXITSTATUS(st)) {
+            failed++;
+            msg("parallel worker %ld (pid %d) failed (status 0x%x)", i,
+                    (int)pids[i], st);
+            continue;
+        }
+        cmds += res[i].cmds;
+        hist_record(&t->h, res[i].ns);
+    }
+    msg("parallel=%ld: %lu failed, %lu commands in %.1fus (%.0f ops/s)",
+            workers, failed, cmds, wall / 1e3, cmds / (wall / 1e9));
+
+    free(pids);
+    free(res);
+    free(reported);
+}
+
+typedef void block_func(const char *opt, const char * const *body, int n);
+struct block_cmd {
+    block_func * const func;
+    const char * const str;
+    const char * const desc;
+};
+
+static struct block_cmd block_cmds[] = {
+    { block_repeat,   "repeat", "=<n>{ <cmd>... }       run the commands n times" },
+    { block_time,     "time",   "[=<label>]{ <cmd>... } time the commands (histogram shown at exit)" },
+    { block_parallel, "parallel", "=<n>{ <cmd>... }       run the commands in n processes at once" },
+    { NULL, "", "" }
+};
+
 typedef void cmd_func(const char *opt);
 struct cmd {
     cmd_func * const func;
@@ -188,24 +623,30 @@ struct cmd {
 };
 
 static cmd_func
-    show_msg, show_pid, do_sleep, do_daemon, detach_from_console,
-    do_system, move_to_user, session_create, help;
+    show_msg, show_pid, do_sleep, do_daemon, daemon_state, detach_from_console,
+    do_system, do_spawn, set_expect, move_to_user, session_create, do_script,
+    help;
 
 static struct cmd all_cmds[] = {
     { show_msg,       "msg",    "=<text>   print text to stderr" },
     { show_pid,       "pid",    "=<text>   print pid and text to stderr" },
     { do_sleep,       "sleep",  "=<secs>   sleep(secs)" },
     { do_daemon,      "daemon", "=sys      system daemon(3)\n"
-                                "=ours     non-Apple version" },
+                                "=ours     non-Apple version\n"
+                                "=<which>:<nochdir><noclose>  with those flags (default 10)" },
+    { daemon_state,   "daemon-state", "          report pid change, session, cwd and fds 0-2" },
     { detach_from_console,
                       "detach", "          _vprocmgr_detach_from_console(0)", },
     { do_system,      "system", "=<cmd>    system(cmd)"},
+    { do_spawn,       "spawn",  "=<cmd>    posix_spawn cmd (split on blanks) capturing its output" },
+    { set_expect,     "expect", "=<file>   later spawns compare their stdout with file (empty: stop)" },
     { move_to_user,   "move-to-user",
                                 "=10.5     _vprocmgr_move_subset_to_user(uid,\"Background\")\n"
                                 "=10.6         call with extra arg == 0\n"
                                 "=10.10    custom implementation simulating _vprocmgr_move_subset_to_user" },
     { session_create, "session-create",
                                 "=<a>,<b>  SessionCreate(a,b) (numeric a and b)" },
+    { do_script,      "script", "=<file>   run the commands in file" },
     { help,           "help",   "          show this help text" },
     { NULL, "", "" }
 };
@@ -225,9 +666,13 @@ static void help(const char *opt UNUSED) {
         }
         msg("    %*s%s", cmd_width, c->str, s);
     }
+    struct block_cmd *b;
+    for (b = block_cmds; b->func; b++)
+        msg("    %*s%s", cmd_width, b->str, b->desc);
 }
 
 static void run_cmd(const char *cmd) {
+    cmds_run++;
     const char *opt = strchr(cmd, '=');
     size_t cmd_len = opt ? (size_t)(opt-cmd) : strlen(cmd);
     if (!cmd_len)
@@ -244,7 +689,56 @@ static void run_cmd(const char *cmd) {
     die(1, "unknown command: %s (try help)", cmd);
 }
 
+/* number of tokens up to and including the "}" closing toks[0]'s block */
+static int block_len(const char * const *toks, int n) {
+    int i, depth = 0;
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(toks[i]);
+        if (len && toks[i][len-1] == '{')
+            depth++;
+        else if (!strcmp(toks[i], "}") && !--depth)
+            return i + 1;
+    }
+    die(1, "no \"}\" closes \"%s\"", toks[0]);
+}
+
+static void run_block(const char *head, const char * const *body, int n) {
+    size_t head_len = strlen(head) - 1; /* without the '{' */
+    const char *opt = memchr(head, '=', head_len);
+    size_t cmd_len = opt ? (size_t)(opt-head) : head_len;
+    char optbuf[256];
+    if (opt) {
+        opt++;
+        snprintf(optbuf, sizeof(optbuf), "%.*s", (int)(head + head_len - opt), opt);
+        opt = optbuf;
+    }
+    struct block_cmd *b;
+    for (b = block_cmds; b->func; b++)
+        if (!strncmp(head, b->str, cmd_len) &&
+                b->str[cmd_len] == '\0') {
+            b->func(opt, body, n);
+            return;
+        }
+    die(1, "unknown block command: %s (try help)", head);
+}
+
+static void run_seq(const char * const *toks, int n) {
+    int i = 0;
+    while (i < n) {
+        size_t len = strlen(toks[i]);
+        if (len && toks[i][len-1] == '{') {
+            int blen = block_len(toks + i, n - i);
+            run_block(toks[i], toks + i + 1, blen - 2);
+            i += blen;
+        } else if (!strcmp(toks[i], "}"))
+            die(1, "unmatched \"}\"");
+        else
+            run_cmd(toks[i++]);
+    }
+}
+
 int main(int argc, const char * const argv[]) {
+    start_pid = getpid();
     if ((out_fd = dup(2)) < 0)
         die_errno(1, "dup msgout");
     FILE *out = fdopen(out_fd, "w");
@@ -257,9 +751,7 @@ int main(int argc, const char * const argv[]) {
                 "    Run \"%s help\" for command list.\n",
                 argv[0], argv[0]);
 
-    const char * const * cmds = argv+1;
-    while(*cmds)
-        run_cmd(*cmds++);
+    run_seq(argv+1, argc-1);
 
     return 0;
 }
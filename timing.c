@@ -0,0 +1,25 @@
+#include <stdint.h>
+
+#include "timing.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+
+/* clock_gettime(2) only showed up in 10.12 */
+uint64_t now_ns(void)
+{
+    static mach_timebase_info_data_t tb;
+    if (!tb.denom)
+        mach_timebase_info(&tb);
+    return mach_absolute_time() * tb.numer / tb.denom;
+}
+#else
+#include <time.h>
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
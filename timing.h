@@ -0,0 +1,3 @@
+#include <stdint.h>
+
+uint64_t now_ns(void);
@@ -0,0 +1,222 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/errno.h>
+#ifdef __APPLE__
+#include <pthread.h>
+#else
+#include <sys/syscall.h>
+#endif
+
+#include "msg.h"
+#include "timing.h"
+#include "trace.h"
+
+/*
+ * Events are kept in memory and written with O_APPEND writes of whole
+ * lines (at trace_flush, which must come before any exec, or at exit),
+ * so wrappers started from many panes at once can share one file
+ * without interleaving inside an event. Each event records the thread
+ * that made it. The file is a JSON array that is never closed, which
+ * the trace viewers accept; whoever creates it writes the "[" with its
+ * first events.
+ *
+ * Timestamps come from the monotonic clock, so events from different
+ * processes line up.
+ *
+ * As in msg.c, events go into a ring whose slots are claimed with an
+ * atomic increment, so a move left running on its own thread (see
+ * REATTACH_TIMEOUT_MS) can trace alongside the main one; whoever
+ * flushes writes every slot that is complete.
+ */
+
+#define MAX_EVENTS 64
+#define EVENT_SIZE 160
+
+struct event {
+    uint32_t ready;
+    int tid;
+    char ph;
+    const char *name, *arg;
+    uint64_t ns;
+};
+
+int trace_on;
+static const char *trace_path;
+static struct event events[MAX_EVENTS];
+static uint64_t events_head, events_tail;
+static int flushing;
+
+void trace_init(void)
+{
+    const char *p = getenv("REATTACH_TRACE");
+
+    if (!(p && *p))
+        return;
+    trace_path = p;
+    trace_on = 1;
+    atexit(trace_flush);
+}
+
+static struct event *claim(void)
+{
+    uint64_t h;
+    for (;;) {
+        h = __atomic_load_n(&events_head, __ATOMIC_RELAXED);
+        if (h - __atomic_load_n(&events_tail, __ATOMIC_ACQUIRE) >= MAX_EVENTS) {
+            trace_flush();
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&events_head, &h, h + 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return &events[h % MAX_EVENTS];
+    }
+}
+
+/* the calling thread, as the trace viewers should group it */
+static int thread_id(void)
+{
+#ifdef __APPLE__
+    return (int)pthread_mach_thread_np(pthread_self());
+#else
+    return (int)syscall(SYS_gettid);
+#endif
+}
+
+void trace_event(char ph, const char *name, const char *arg)
+{
+    struct event *e = claim();
+
+    e->tid = thread_id();
+    e->ph = ph;
+    e->name = name;
+    e->arg = arg;
+    e->ns = now_ns();
+    __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+}
+
+/* append s at buf+n; the result is size once something did not fit */
+static size_t put(char *buf, size_t size, size_t n, const char *s)
+{
+    size_t l = strlen(s);
+    if (n + l < size)
+        memcpy(buf + n, s, l);
+    return n + l < size ? n + l : size;
+}
+
+static size_t put_json(char *buf, size_t size, size_t n, const char *s)
+{
+    for (; *s && n < size; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            char esc[3] = { '\\', c, '\0' };
+            n = put(buf, size, n, esc);
+        } else if (c < 0x20) {
+            char esc[7];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            n = put(buf, size, n, esc);
+        } else if (n + 1 < size)
+            buf[n++] = c;
+        else
+            n = size;
+    }
+    return n;
+}
+
+/* append e as a line of the array; with its arg only if args is set */
+static size_t put_event(char *buf, size_t size, size_t n, const struct event *e, int args)
+{
+    int r = snprintf(buf + n, size - n,
+            "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,"
+            "\"pid\":%d,\"tid\":%d%s",
+            e->name, e->ph,
+            (unsigned long long)(e->ns / 1000), (unsigned)(e->ns % 1000),
+            (int)getpid(), e->tid,
+            e->ph == 'i' ? ",\"s\":\"p\"" : "");
+
+    if (r < 0 || (size_t)r >= size - n)
+        return size;
+    n += r;
+    if (args && e->arg) {
+        n = put(buf, size, n, ",\"args\":{\"arg\":\"");
+        n = put_json(buf, size, n, e->arg);
+        n = put(buf, size, n, "\"}");
+    }
+    return put(buf, size, n, "},\n");
+}
+
+static int write_buf(int fd, const char *buf, size_t n)
+{
+    if (write(fd, buf, n) == (ssize_t)n)
+        return 0;
+    warn_errno("unable to write trace file %s", trace_path);
+    return -1;
+}
+
+/* mark the n complete events from t written (or dropped) */
+static void release(uint64_t t, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        __atomic_store_n(&events[(t + i) % MAX_EVENTS].ready, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&events_tail, t + n, __ATOMIC_RELEASE);
+    __atomic_clear(&flushing, __ATOMIC_RELEASE);
+}
+
+void trace_flush(void)
+{
+    char buf[2 + MAX_EVENTS * EVENT_SIZE];
+    size_t n = 0, first;
+    int i, fd, count = 0, err = errno;
+
+    while (__atomic_test_and_set(&flushing, __ATOMIC_ACQUIRE))
+        ;
+    uint64_t t = events_tail, h = __atomic_load_n(&events_head, __ATOMIC_ACQUIRE);
+    while (t + count < h &&
+            __atomic_load_n(&events[(t + count) % MAX_EVENTS].ready, __ATOMIC_ACQUIRE))
+        count++;
+    if (!count) {
+        __atomic_clear(&flushing, __ATOMIC_RELEASE);
+        return;
+    }
+
+    /* the "[" goes out in the same write as the first events, so nobody
+     * appending to the file we just created can get in ahead of it */
+    if ((fd = open(trace_path, O_WRONLY|O_APPEND|O_CREAT|O_EXCL, 0644)) >= 0)
+        n = put(buf, sizeof(buf), n, "[\n");
+    else if ((fd = open(trace_path, O_WRONLY|O_APPEND)) < 0) {
+        warn_errno("unable to open trace file %s", trace_path);
+        trace_on = 0;
+        release(t, count);
+        errno = err;
+        return;
+    }
+
+    first = n;
+    for (i = 0; i < count; i++) {
+        const struct event *e = &events[(t + i) % MAX_EVENTS];
+        size_t start = n;
+
+        if ((n = put_event(buf, sizeof(buf), n, e, 1)) < sizeof(buf))
+            continue;
+        if (start > first) {
+            /* full: write out the events before this one and start over */
+            if (write_buf(fd, buf, start))
+                break;
+            start = first = 0;
+            if ((n = put_event(buf, sizeof(buf), 0, e, 1)) < sizeof(buf))
+                continue;
+        }
+        /* too long even on its own: keep the event, without its arg */
+        n = put_event(buf, sizeof(buf), start, e, 0);
+    }
+    if (i == count)
+        write_buf(fd, buf, n);
+    close(fd);
+    release(t, count);
+    errno = err;
+}
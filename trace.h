@@ -0,0 +1,13 @@
+/*
+ * REATTACH_TRACE=<file>: Chrome trace-event JSON of where startup time
+ * goes. When it is not set each TRACE_* costs one branch.
+ */
+extern int trace_on;
+
+void trace_init(void);
+void trace_event(char ph, const char *name, const char *arg);
+void trace_flush(void);
+
+#define TRACE_BEGIN(NAME, ARG) do { if (trace_on) trace_event('B', NAME, ARG); } while (0)
+#define TRACE_END(NAME, ARG)   do { if (trace_on) trace_event('E', NAME, ARG); } while (0)
+#define TRACE_MARK(NAME, ARG)  do { if (trace_on) trace_event('i', NAME, ARG); } while (0)
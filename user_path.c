@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/errno.h>
+#include <sys/stat.h>
+
+#include "msg.h"
+#include "user_path.h"
+
+/*
+ * Build "$TMPDIR/reattach-to-user-namespace.<uid>/<name>" in buf.
+ *
+ * The directory is created (mode 0700) if it is missing; if it exists
+ * it must be a directory owned by us that nobody else can write to,
+ * since what we keep there (sockets, caches) is trusted later on.
+ *
+ * Returns 0 on success, -1 (with a warning) on failure.
+ */
+int user_path(char *buf, size_t size, const char *name)
+{
+    const char *tmp = getenv("TMPDIR");
+    uid_t uid = getuid();
+    int n;
+
+    if (!(tmp && *tmp))
+        tmp = "/tmp";
+    n = snprintf(buf, size, "%s%sreattach-to-user-namespace.%u",
+            tmp, tmp[strlen(tmp)-1] == '/' ? "" : "/", (unsigned)uid);
+    if (n < 0 || (size_t)n >= size) {
+        warn("per-user directory name too long");
+        return -1;
+    }
+
+    struct stat st;
+    if (mkdir(buf, 0700) && errno != EEXIST) {
+        warn_errno("unable to create %s", buf);
+        return -1;
+    }
+    if (lstat(buf, &st)) {
+        warn_errno("unable to stat %s", buf);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != uid ||
+            (st.st_mode & (S_IWGRP|S_IWOTH))) {
+        warn("refusing to use %s: not a private directory", buf);
+        return -1;
+    }
+
+    n += snprintf(buf + n, size - n, "/%s", name);
+    if ((size_t)n >= size) {
+        warn("per-user file name too long");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,3 @@
+#include <stddef.h>
+
+int user_path(char *buf, size_t size, const char *name);